@@ -1,145 +1,683 @@
+#include <fcntl.h>
 #include <limits.h>
-#include <semaphore.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "cache.h"
 #include "utils.h"
 
-#define P(s) sem_wait(s)
-#define V(s) sem_post(s)
+#define CACHE_MAGIC 0xf0c0cac4
+#define CACHE_REAP_BATCH 64 /* Items a put looks at for a lazy purge */
 
-sem_t mutex, w;
-static int readcnt = 0;
+#define KEY(shm, it) ((shm)->data + (it)->off)
 
-struct cache Make_cache(void)
+#define HUGE_PAGE_SIZE (2UL << 20) /* The mapping is aligned to these */
+#define MAPLEN ((sizeof(struct ca_shared) + HUGE_PAGE_SIZE - 1) & \
+		~(HUGE_PAGE_SIZE - 1))
+
+/*
+ * empty - drop every item and lazy purge
+ */
+static void empty(struct ca_shared *shm)
+{
+	shm->size = shm->top = 0;
+	shm->cnt = 0;
+	shm->nrules = 0;
+	memset(shm->items, 0, sizeof shm->items);
+}
+
+static void init_shared(struct ca_shared *shm)
+{
+	pthread_mutexattr_t attr;
+	int rc;
+
+	if ((rc = pthread_mutexattr_init(&attr)) != 0 ||
+	    (rc = pthread_mutexattr_setpshared(&attr,
+					       PTHREAD_PROCESS_SHARED)) != 0 ||
+	    (rc = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST)) !=
+		0 ||
+	    (rc = pthread_mutex_init(&shm->w, &attr)) != 0) {
+		posix_error(rc, "pthread_mutex_init");
+	}
+	for (int i = 0; i < CACHE_RSLOTS; ++i) {
+		if ((rc = pthread_mutex_init(&shm->r[i], &attr)) != 0) {
+			posix_error(rc, "pthread_mutex_init");
+		}
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	shm->dirty = 0;
+	shm->hits = shm->misses = 0;
+	shm->gen = 0;
+	empty(shm);
+
+	shm->layout = sizeof *shm;
+	__atomic_store_n(&shm->magic, CACHE_MAGIC, __ATOMIC_RELEASE);
+}
+
+/*
+ * lock - lock m, taking it over if its owner died holding it. Whether that
+ *     left the cache half-changed is for dirty to say, not the lock.
+ */
+static void lock(pthread_mutex_t *m)
+{
+	const int rc = pthread_mutex_lock(m);
+	if (rc == EOWNERDEAD) {
+		pthread_mutex_consistent(m);
+	} else if (rc != 0) {
+		posix_error(rc, "pthread_mutex_lock");
+	}
+}
+
+/*
+ * read_lock - lock out writers, but not other readers, which each take one
+ *     of CACHE_RSLOTS locks, a thread always the same one. Returns the lock
+ *     to unlock.
+ */
+static pthread_mutex_t *read_lock(struct ca_shared *shm)
+{
+	static int next_slot;
+	static __thread int slot = -1;
+
+	if (slot < 0) {
+		slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) %
+		       CACHE_RSLOTS;
+	}
+	lock(&shm->r[slot]);
+	return &shm->r[slot];
+}
+
+/*
+ * write_lock - lock out every reader and writer, in every process mapping
+ *     the cache. If a writer died halfway through a change, nothing in the
+ *     cache can be trusted, so it is emptied.
+ */
+static void write_lock(struct ca_shared *shm)
+{
+	lock(&shm->w);
+	for (int i = 0; i < CACHE_RSLOTS; ++i) {
+		lock(&shm->r[i]);
+	}
+	if (shm->dirty) {
+		fprintf(stderr, "cache: a writer died mid-change; emptying\n");
+		empty(shm);
+	}
+	shm->dirty = 1;
+}
+
+static void write_unlock(struct ca_shared *shm)
+{
+	shm->dirty = 0;
+	for (int i = CACHE_RSLOTS - 1; i >= 0; --i) {
+		pthread_mutex_unlock(&shm->r[i]);
+	}
+	pthread_mutex_unlock(&shm->w);
+}
+
+/*
+ * map_cache - map MAPLEN bytes for the cache from the shared-memory segment
+ *     fd or, if it is -1, privately. Reserved huge pages are used if the
+ *     system has any to spare, else transparent ones are asked for on a
+ *     mapping aligned for them, so the whole cache takes a TLB entry or so
+ *     rather than hundreds. Sets *backing to which it got.
+ */
+static void *map_cache(int fd, int *backing)
+{
+	const size_t len = MAPLEN;
+	char *p;
+
+	if (fd < 0) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			*backing = CACHE_HUGETLB;
+			return p;
+		}
+	}
+
+	/* Reserve a huge page more than needed, and keep the aligned part */
+	char *base = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_NONE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		return MAP_FAILED;
+	}
+	p = (char *)(((uintptr_t)base + HUGE_PAGE_SIZE - 1) &
+		     ~(HUGE_PAGE_SIZE - 1));
+	if (p > base) {
+		munmap(base, p - base);
+	}
+	munmap(p + len, base + HUGE_PAGE_SIZE - p);
+
+	const int flags = fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED;
+	if (mmap(p, len, PROT_READ | PROT_WRITE, flags | MAP_FIXED, fd, 0) ==
+	    MAP_FAILED) {
+		munmap(p, len);
+		return MAP_FAILED;
+	}
+	*backing = madvise(p, len, MADV_HUGEPAGE) == 0 ? CACHE_THP
+						       : CACHE_SMALLPAGES;
+	return p;
+}
+
+/*
+ * Make_cache - create the cache. With a name, it lives in that POSIX
+ *     shared-memory segment: a cache left there by an earlier process (such
+ *     as the one handing over its listener) is attached to, warm, and is
+ *     shared with it while both run. Without one it is private. Either way
+ *     it is put on huge pages where it can be.
+ */
+struct cache Make_cache(const char *name)
 {
-	if (sem_init(&mutex, 0, 1) < 0) {
-		unix_error("sem_init");
+	struct cache c = {NULL, MAPLEN, CACHE_SMALLPAGES};
+	const size_t len = MAPLEN;
+
+	if (name == NULL) {
+		if ((c.shm = map_cache(-1, &c.backing)) == MAP_FAILED) {
+			unix_error("mmap");
+		}
+		init_shared(c.shm);
+		return c;
 	}
-	if (sem_init(&w, 0, 1) < 0) {
-		unix_error("sem_init");
+
+	int fd, created = 1;
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+		if (errno != EEXIST ||
+		    (fd = shm_open(name, O_RDWR, 0600)) < 0) {
+			unix_error("shm_open");
+		}
+		created = 0;
 	}
 
-	struct ca_item *head = NULL, *tail = NULL;
-	if ((head = malloc(sizeof *head)) == NULL) {
-		unix_error("malloc");
+	struct stat st;
+	if (!created && (fstat(fd, &st) < 0 || st.st_size != len)) {
+		/* Left by an incompatible build; start over with a new segment,
+		 * which leaves the old one to whoever still maps it */
+		fprintf(stderr, "Make_cache: replacing incompatible %s\n",
+			name);
+		close(fd);
+		if (shm_unlink(name) < 0) {
+			unix_error("shm_unlink");
+		}
+		return Make_cache(name);
 	}
-	if ((tail = malloc(sizeof *tail)) == NULL) {
-		unix_error("malloc");
+	if (created && ftruncate(fd, len) < 0) {
+		unix_error("ftruncate");
+	}
+
+	struct ca_shared *shm = c.shm = map_cache(fd, &c.backing);
+	if (shm == MAP_FAILED) {
+		unix_error("mmap");
 	}
+	close(fd);
 
-	head->size = head->cnt = 0;
-	head->next = tail;
-	tail->prev = head;
-	head->prev = tail->next = NULL;
+	if (created) {
+		init_shared(shm);
+	} else if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) !=
+		   CACHE_MAGIC) {
+		fprintf(stderr, "Make_cache: %s is not initialized\n", name);
+		exit(1);
+	} else if (shm->layout != sizeof *shm) {
+		/* Rounded up to the same size by an incompatible build */
+		fprintf(stderr, "Make_cache: replacing incompatible %s\n",
+			name);
+		munmap(shm, len);
+		if (shm_unlink(name) < 0) {
+			unix_error("shm_unlink");
+		}
+		return Make_cache(name);
+	} else {
+		printf("Attached to cache %s with %d items\n", name, shm->cnt);
+	}
 
-	struct cache c = {head, tail};
 	return c;
 }
 
-int get_cache(const struct cache *cache, const char *key, void *item,
-	      size_t *size)
+/*
+ * index_lower, index_upper - the first position in the key index whose key
+ *     compares, over its first n bytes, not less than (lower) or greater
+ *     than (upper) key. With n counting key's '\0' the whole keys compare;
+ *     with n = strlen(key), [lower, upper) is the run of keys starting with
+ *     key.
+ */
+static int index_lower(const struct ca_shared *shm, const char *key, size_t n)
 {
-	int found = 0;
+	int lo = 0, hi = shm->cnt;
+	while (lo < hi) {
+		const int mid = lo + (hi - lo) / 2;
+		const struct ca_item *it = &shm->items[shm->index[mid]];
+		if (strncmp(KEY(shm, it), key, n) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
 
-	P(&mutex);
-	if (++readcnt == 1) {
-		P(&w);
+static int index_upper(const struct ca_shared *shm, const char *key, size_t n)
+{
+	int lo = 0, hi = shm->cnt;
+	while (lo < hi) {
+		const int mid = lo + (hi - lo) / 2;
+		const struct ca_item *it = &shm->items[shm->index[mid]];
+		if (strncmp(KEY(shm, it), key, n) <= 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
-	V(&mutex);
+	return lo;
+}
 
+/*
+ * find_item - the position of key in the key index, or -1
+ */
+static int find_item(const struct ca_shared *shm, const char *key)
+{
+	const size_t n = strlen(key) + 1;
+	const int pos = index_lower(shm, key, n);
+	if (pos < shm->cnt &&
+	    strcmp(KEY(shm, &shm->items[shm->index[pos]]), key) == 0) {
+		return pos;
+	}
+	return -1;
+}
+
+/*
+ * stale - whether a lazy purge has done away with it
+ */
+static int stale(const struct ca_shared *shm, const struct ca_item *it)
+{
+	for (int i = 0; i < shm->nrules; ++i) {
+		const struct ca_rule *r = &shm->rules[i];
+		if (it->gen < r->gen &&
+		    strncmp(KEY(shm, it), r->prefix, strlen(r->prefix)) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int get_cache(const struct cache *cache, const char *key, void **item,
+	      size_t *size)
+{
+	struct ca_shared *shm = cache->shm;
+	int found = 0;
+
+	pthread_mutex_t *m = read_lock(shm);
 	/********** CRITICAL SECTION **********/
-	for (struct ca_item *it = cache->head->next; it != cache->tail;
-	     it = it->next) {
-		if (strcmp(key, it->key) == 0) {
-			memcpy(item, it->item, it->size);
+	/* Left half-changed by a dead writer, until the next put empties it */
+	const int pos = shm->dirty ? -1 : find_item(shm, key);
+	struct ca_item *it = pos >= 0 ? &shm->items[shm->index[pos]] : NULL;
+	if (it != NULL && !stale(shm, it)) {
+		if ((*item = malloc(it->size)) == NULL) {
+			msg_unix_error("malloc");
+		} else {
+			memcpy(*item, KEY(shm, it) + it->key_len, it->size);
 			*size = it->size;
-			++it->cnt;
+			/* Saturate, as cnt > 0 also marks the slot in use */
+			int cnt = __atomic_load_n(&it->cnt, __ATOMIC_RELAXED);
+			while (cnt < INT_MAX &&
+			       !__atomic_compare_exchange_n(
+				   &it->cnt, &cnt, cnt + 1, 1,
+				   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				;
 			found = 1;
-			break;
 		}
 	}
 	/**************************************/
+	pthread_mutex_unlock(m);
 
-	P(&mutex);
-	if (--readcnt == 0) {
-		V(&w);
+	return found ? 0 : -1;
+}
+
+/*
+ * drop_at - free the slot at position pos of the key index, and its bytes,
+ *     which compact() reclaims
+ */
+static void drop_at(struct ca_shared *shm, int pos)
+{
+	struct ca_item *it = &shm->items[shm->index[pos]];
+
+	shm->size -= it->key_len + it->size;
+	--shm->cnt;
+	it->cnt = 0;
+	memmove(&shm->index[pos], &shm->index[pos + 1],
+		(shm->cnt - pos) * sizeof *shm->index);
+}
+
+/*
+ * drop_item - free a slot, finding it in the key index by its key
+ */
+static void drop_item(struct ca_shared *shm, struct ca_item *it)
+{
+	drop_at(shm, index_lower(shm, KEY(shm, it), it->key_len));
+}
+
+/*
+ * reap - drop up to batch of the items the oldest lazy purge did away
+ *     with, and retire it once none are left. A batch of 0 means all.
+ *     Called with w held.
+ */
+static void reap(struct ca_shared *shm, int batch)
+{
+	if (shm->nrules == 0) {
+		return;
 	}
-	V(&mutex);
 
-	return found ? 0 : -1;
+	const struct ca_rule *r = &shm->rules[0];
+	const size_t n = strlen(r->prefix);
+	const int end = index_upper(shm, r->prefix, n);
+	int pos = index_lower(shm, r->prefix, n), left = end - pos;
+	/* Only drops count against the batch: items put since the purge are
+	 * kept and skipped, or enough of them would stall it for good */
+	for (int dropped = 0; left > 0; --left) {
+		if (shm->items[shm->index[pos]].gen >= r->gen) {
+			++pos;
+		} else if (dropped == batch && batch > 0) {
+			return; /* The rest next time */
+		} else {
+			drop_at(shm, pos);
+			++dropped;
+		}
+	}
+
+	--shm->nrules;
+	memmove(&shm->rules[0], &shm->rules[1],
+		shm->nrules * sizeof *shm->rules);
 }
 
-int put_cache(struct cache *cache, const char *key, const void *item,
-	      size_t size)
+static const struct ca_shared *sort_shm;
+
+static int cmp_off(const void *a, const void *b)
+{
+	const size_t x = sort_shm->items[*(const int *)a].off;
+	const size_t y = sort_shm->items[*(const int *)b].off;
+	return (x > y) - (x < y);
+}
+
+/*
+ * compact - slide the live items down over the holes left by dropped ones,
+ *     so the free space is all at top. Called with w held.
+ */
+static int compact(struct ca_shared *shm)
 {
-	if (size > MAX_OBJECT_SIZE) {
+	int *order = malloc(shm->cnt * sizeof *order);
+	if (order == NULL && shm->cnt > 0) {
+		msg_unix_error("malloc");
 		return -1;
 	}
 
-	struct ca_item *new_it = malloc(sizeof *new_it);
-	if (new_it == NULL) {
-		goto malloc_err;
+	int n = 0;
+	for (int i = 0; i < MAX_CACHE_ITEMS; ++i) {
+		if (shm->items[i].cnt > 0) {
+			order[n++] = i;
+		}
 	}
+	sort_shm = shm; /* Only ever called by the writer */
+	qsort(order, n, sizeof *order, cmp_off);
 
-	void *item_cpy = malloc(size);
-	if (item_cpy == NULL) {
-		free(new_it);
-		goto malloc_err;
+	size_t top = 0;
+	for (int i = 0; i < n; ++i) {
+		struct ca_item *it = &shm->items[order[i]];
+		const size_t len = it->key_len + it->size;
+		memmove(shm->data + top, shm->data + it->off, len);
+		it->off = top;
+		top += len;
 	}
+	shm->top = top;
 
-	void *key_cpy = strdup(key);
-	if (key_cpy == NULL) {
-		free(new_it);
-		free(item_cpy);
-		goto malloc_err;
-	}
+	free(order);
+	return 0;
+}
 
-	memcpy(item_cpy, item, size);
+int put_cache(struct cache *cache, const char *key, const void *item,
+	      size_t size)
+{
+	struct ca_shared *shm = cache->shm;
+	const size_t key_len = strlen(key) + 1;
+	const size_t len = key_len + size;
+	int rc = -1;
 
-	new_it->size = size;
-	new_it->cnt = 1;
-	new_it->key = key_cpy;
-	new_it->item = item_cpy;
+	if (size > MAX_OBJECT_SIZE || len > MAX_CACHE_SIZE) {
+		return -1;
+	}
 
-	P(&w);
+	write_lock(shm);
 	/********** CRITICAL SECTION **********/
-	size_t free_space = MAX_CACHE_SIZE - cache->head->size;
-	while (free_space < size) {
+	reap(shm, CACHE_REAP_BATCH);
+
+	/* Replace an older copy */
+	int pos = find_item(shm, key);
+	struct ca_item *slot = NULL;
+	if (pos >= 0) {
+		slot = &shm->items[shm->index[pos]];
+		drop_at(shm, pos);
+	}
+	for (int i = 0; slot == NULL && i < MAX_CACHE_ITEMS; ++i) {
+		if (shm->items[i].cnt == 0) {
+			slot = &shm->items[i];
+		}
+	}
+
+	while (MAX_CACHE_SIZE - shm->size < len || slot == NULL) {
 		/* Evict */
-		struct ca_item *it, *cand;
+		struct ca_item *cand = NULL;
 		int min = INT_MAX;
-		for (it = cache->head->next; it != cache->tail; it = it->next) {
-			if (it->cnt < min) {
+		for (int i = 0; i < MAX_CACHE_ITEMS; ++i) {
+			struct ca_item *it = &shm->items[i];
+			if (it->cnt > 0 && it->cnt < min) {
 				min = it->cnt;
 				cand = it;
 			}
 		}
+		drop_item(shm, cand);
+		slot = slot ? slot : cand;
+	}
 
-		cache->head->size -= cand->size;
-		--cache->head->cnt;
+	if (MAX_CACHE_SIZE - shm->top < len && compact(shm) < 0) {
+		goto out;
+	}
 
-		cand->prev->next = cand->next;
-		cand->next->prev = cand->prev;
+	slot->off = shm->top;
+	slot->key_len = key_len;
+	slot->size = size;
+	slot->cnt = 1;
+	slot->gen = ++shm->gen;
+	memcpy(KEY(shm, slot), key, key_len);
+	memcpy(KEY(shm, slot) + key_len, item, size);
 
-		free(cand->key);
-		free(cand->item);
-		free(cand);
+	pos = index_lower(shm, key, key_len);
+	memmove(&shm->index[pos + 1], &shm->index[pos],
+		(shm->cnt - pos) * sizeof *shm->index);
+	shm->index[pos] = slot - shm->items;
+
+	shm->top += len;
+	shm->size += len;
+	++shm->cnt;
+	rc = 0;
+	/**************************************/
+out:
+	write_unlock(shm);
+
+	return rc;
+}
+
+/*
+ * purge_cache - drop the item for key prefix and its Vary variants (the
+ *     keys that continue with a '\n') if exact is set, else every item whose
+ *     key starts with prefix. The matches are found in the key index, so
+ *     they are all that is looked at, and a purge of more than
+ *     CACHE_PURGE_EAGER of them only records a lazy purge, which puts then
+ *     carry out. Returns the number of items purged.
+ */
+int purge_cache(struct cache *cache, const char *prefix, int exact)
+{
+	struct ca_shared *shm = cache->shm;
+	const size_t n = strlen(prefix);
+	int purged = 0;
+
+	/* The variants of key are the keys starting with "key\n" */
+	char *variants = NULL;
+	if (exact) {
+		if ((variants = malloc(n + 2)) == NULL) {
+			msg_unix_error("malloc");
+			return -1;
+		}
+		memcpy(variants, prefix, n);
+		memcpy(variants + n, "\n", 2);
 	}
 
-	new_it->next = cache->head->next;
-	cache->head->next = new_it;
-	new_it->prev = cache->head;
-	new_it->next->prev = new_it;
+	write_lock(shm);
+	/********** CRITICAL SECTION **********/
+	if (exact) {
+		const int pos = find_item(shm, prefix);
+		if (pos >= 0) {
+			drop_at(shm, pos);
+			++purged;
+		}
+		prefix = variants;
+	}
 
-	cache->head->size += size;
-	++cache->head->cnt;
+	const size_t len = strlen(prefix);
+	const int lo = index_lower(shm, prefix, len);
+	const int hi = index_upper(shm, prefix, len);
+	if (hi - lo <= CACHE_PURGE_EAGER || len >= CACHE_RULE_LEN) {
+		for (int i = lo; i < hi; ++i) {
+			drop_at(shm, lo);
+		}
+	} else {
+		if (shm->nrules == CACHE_MAXRULES) {
+			reap(shm, 0); /* Make room */
+		}
+		struct ca_rule *r = &shm->rules[shm->nrules++];
+		r->gen = ++shm->gen;
+		memcpy(r->prefix, prefix, len + 1);
+	}
+	purged += hi - lo;
 	/**************************************/
-	V(&w);
+	write_unlock(shm);
 
-	return 0;
+	free(variants);
+	return purged;
+}
 
-malloc_err:
-	msg_unix_error("malloc");
-	return -1;
+/*
+ * cache_detach - wait for any cache operation in progress and keep new
+ *     ones from starting, so that the process can exit without leaving the
+ *     cache half-changed. It exits holding the locks, which the robust
+ *     locking hands on to whoever waits for them next.
+ */
+void cache_detach(struct cache *cache)
+{
+	struct ca_shared *shm = cache->shm;
+
+	lock(&shm->w);
+	for (int i = 0; i < CACHE_RSLOTS; ++i) {
+		lock(&shm->r[i]);
+	}
+}
+
+/*
+ * cache_count - count a lookup as a hit or a miss for cache_stats(). It is
+ *     up to the caller, as one lookup can take several get_cache() calls.
+ */
+void cache_count(struct cache *cache, int hit)
+{
+	struct ca_shared *shm = cache->shm;
+	__atomic_add_fetch(hit ? &shm->hits : &shm->misses, 1,
+			   __ATOMIC_RELAXED);
+}
+
+/*
+ * huge_bytes - how much of the mapping [start, end) the kernel has put on
+ *     huge pages, from /proc/self/smaps
+ */
+static size_t huge_bytes(uintptr_t start, uintptr_t end)
+{
+	static const char *fields[] = {"AnonHugePages:", "ShmemPmdMapped:",
+				       "Private_Hugetlb:", "Shared_Hugetlb:"};
+	char line[256];
+	size_t kb = 0;
+	int in = 0;
+
+	FILE *fp = fopen("/proc/self/smaps", "r");
+	if (fp == NULL) {
+		return 0;
+	}
+	while (fgets(line, sizeof line, fp) != NULL) {
+		unsigned long lo, hi;
+		size_t n;
+		if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+			in = lo >= start && hi <= end;
+			continue;
+		}
+		for (int i = 0; in && i < 4; ++i) {
+			const size_t flen = strlen(fields[i]);
+			if (strncmp(line, fields[i], flen) == 0 &&
+			    sscanf(line + flen, "%zu", &n) == 1) {
+				kb += n;
+			}
+		}
+	}
+	fclose(fp);
+	return kb * 1024;
+}
+
+/*
+ * node_pages - count the resident pages of the mapping [p, p + len) on each
+ *     NUMA node, as move_pages(2) reports them without moving any
+ */
+static void node_pages(char *p, size_t len, size_t *count)
+{
+	const size_t pagesize = sysconf(_SC_PAGESIZE);
+	const size_t n = len / pagesize;
+	void **pages = malloc(n * sizeof *pages);
+	int *status = malloc(n * sizeof *status);
+
+	if (pages != NULL && status != NULL) {
+		for (size_t i = 0; i < n; ++i)
+			pages[i] = p + i * pagesize;
+		if (syscall(SYS_move_pages, 0, n, pages, NULL, status, 0) ==
+		    0) {
+			for (size_t i = 0; i < n; ++i) {
+				if (status[i] >= 0 &&
+				    status[i] < CACHE_MAXNODES) {
+					++count[status[i]];
+				}
+			}
+		}
+	}
+	free(pages);
+	free(status);
+}
+
+/*
+ * cache_stats - report the cache's footprint and how it sits in memory: how
+ *     much is on huge pages and which NUMA nodes its pages are on, for sizing
+ *     and tuning
+ */
+void cache_stats(const struct cache *cache, struct cache_stats *st)
+{
+	struct ca_shared *shm = cache->shm;
+
+	memset(st, 0, sizeof *st);
+	pthread_mutex_t *m = read_lock(shm);
+	st->used = shm->size;
+	st->items = shm->cnt;
+	pthread_mutex_unlock(m);
+
+	st->mapped = cache->maplen;
+	st->hits = __atomic_load_n(&shm->hits, __ATOMIC_RELAXED);
+	st->misses = __atomic_load_n(&shm->misses, __ATOMIC_RELAXED);
+	st->backing = cache->backing;
+	st->huge = huge_bytes((uintptr_t)shm, (uintptr_t)shm + cache->maplen);
+	node_pages((char *)shm, cache->maplen, st->node_pages);
 }
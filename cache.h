@@ -1,27 +1,86 @@
 #ifndef __CACHE_H__
 #define __CACHE_H__
 
+#include <pthread.h>
 #include <stdlib.h>
 
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
+#define MAX_CACHE_ITEMS 4096
+#define CACHE_MAXRULES 32     /* Lazy purges pending at once */
+#define CACHE_RULE_LEN 512    /* Longest prefix a lazy purge can hold */
+#define CACHE_PURGE_EAGER 256 /* Larger purges are done lazily */
+#define CACHE_RSLOTS 16	      /* Reader locks; a writer takes them all */
+#define CACHE_MAXNODES 8      /* NUMA nodes cache_stats() tells apart */
 
+/*
+ * The cache lives in one mapping, which may be a named shared-memory segment
+ * outliving the process, so it holds offsets rather than pointers and its
+ * locks are process-shared. They are robust too, as a process can die
+ * holding one; dirty tells whether it died halfway through a change.
+ */
 struct ca_item {
-	size_t size; /* cache size for head, item size for items */
-	int cnt;     /* item count for head, touched count for items */
-	char *key;
-	void *item;
-	struct ca_item *next, *prev;
+	size_t off;	/* key, then item, at this offset in data */
+	size_t key_len; /* key length, including its '\0' */
+	size_t size;	/* item size */
+	int cnt;	/* touched count, at most INT_MAX; 0 if unused */
+	size_t gen;	/* ca_shared.gen when it was put */
 };
 
+/* A lazy purge: items under prefix put before gen are gone */
+struct ca_rule {
+	size_t gen;
+	char prefix[CACHE_RULE_LEN];
+};
+
+struct ca_shared {
+	unsigned magic;	 /* CACHE_MAGIC once initialized */
+	size_t layout;	 /* sizeof(struct ca_shared) of the creator */
+	pthread_mutex_t w; /* held by the writer */
+	pthread_mutex_t r[CACHE_RSLOTS]; /* one held by each reader */
+	int dirty;	 /* a writer is changing the cache */
+	size_t size;	 /* bytes of live keys and items */
+	size_t top;	 /* end of the used part of data */
+	int cnt;	 /* live items */
+	unsigned long hits, misses;
+	size_t gen;	 /* bumped by each put and lazy purge */
+	int nrules;	 /* pending lazy purges, oldest first */
+	struct ca_rule rules[CACHE_MAXRULES];
+	int index[MAX_CACHE_ITEMS]; /* cnt live slots, sorted by key */
+	struct ca_item items[MAX_CACHE_ITEMS];
+	char data[MAX_CACHE_SIZE];
+};
+
+/* What the cache mapping was asked to be backed by */
+#define CACHE_SMALLPAGES 0
+#define CACHE_THP 1	/* Transparent huge pages, if the kernel has them */
+#define CACHE_HUGETLB 2 /* Reserved huge pages */
+
 struct cache {
-	struct ca_item *head, *tail;
+	struct ca_shared *shm;
+	size_t maplen; /* bytes mapped, a whole number of huge pages */
+	int backing;
+};
+
+/* How big the cache is and how it is laid out in memory, for tuning */
+struct cache_stats {
+	size_t mapped;	      /* bytes mapped */
+	size_t used;	      /* bytes of live keys and items */
+	int items;	      /* live items */
+	unsigned long hits, misses;
+	int backing;	      /* as in struct cache */
+	size_t huge;	      /* bytes of the mapping on huge pages */
+	size_t node_pages[CACHE_MAXNODES]; /* its resident pages on each */
 };
 
-struct cache Make_cache(void);
-int get_cache(const struct cache *cache, const char *key, void *item,
+struct cache Make_cache(const char *name);
+int get_cache(const struct cache *cache, const char *key, void **item,
 	      size_t *size);
 int put_cache(struct cache *cache, const char *key, const void *item,
 	      size_t size);
+int purge_cache(struct cache *cache, const char *prefix, int exact);
+void cache_count(struct cache *cache, int hit);
+void cache_detach(struct cache *cache);
+void cache_stats(const struct cache *cache, struct cache_stats *st);
 
 #endif /* __CACHE_H__ */
@@ -0,0 +1,221 @@
+/*
+ * fuzz.c - fuzzing harness for the request parsers: the request line, the
+ *     URI and its cache key, the header reader and Vary keys, fed the way
+ *     forward() feeds them.
+ *
+ *     LLVMFuzzerTestOneInput() is the entry point for libFuzzer (build with
+ *     -DLIBFUZZER -fsanitize=fuzzer). Without it, the built-in driver runs
+ *     each file named on the command line once ("-" for stdin, as AFL
+ *     does), or else mutates a few seed requests at random:
+ *
+ *     usage: ./fuzz_http [-n iterations] [-s seed] [file...]
+ */
+
+/* The proxy is built in, so its static parsers are fuzzed as they are */
+#define main proxy_main
+#include "proxy.c"
+#undef main
+
+#include <stdint.h>
+
+#define FUZZ_MAXINPUT (HDR_MAXSIZE + 2 * MAXLINE) /* Longer is no news */
+
+static FILE *input; /* Where each input is put for the rio reader */
+
+/*
+ * fuzz_setup - discard the proxy's logging and open the input file
+ */
+static void fuzz_setup(void)
+{
+	if (freopen("/dev/null", "w", stdout) == NULL) {
+		unix_error("freopen");
+	}
+	if ((input = tmpfile()) == NULL) {
+		unix_error("tmpfile");
+	}
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	static rio_t rio;
+	static char line[MAXLINE], key[MAXLINE], vkey[MAXLINE];
+	static char buf[HDR_MAXSIZE];
+
+	if (size > FUZZ_MAXINPUT) {
+		return 0;
+	}
+	const int fd = fileno(input);
+	if (ftruncate(fd, 0) < 0 || pwrite(fd, data, size, 0) != size ||
+	    lseek(fd, 0, SEEK_SET) < 0) {
+		unix_error("fuzz input");
+	}
+
+	/* The request line, as forward() reads it */
+	rio_readinitb(&rio, fd);
+	if (rio_readlineb(&rio, line, MAXLINE) <= 0) {
+		return 0;
+	}
+	char *method, *uri, *version;
+	if (parse_requestline(line, &method, &uri, &version) < 0) {
+		return 0;
+	}
+	struct uri u;
+	if (parse_uri(uri, &u) < 0 || canon_uri(uri, key, MAXLINE) < 0) {
+		return 0;
+	}
+	/* The path must lie within the URI it points into */
+	if (u.path_len > 0 &&
+	    (u.path < uri || u.path + u.path_len > uri + strlen(uri))) {
+		abort();
+	}
+
+	/* Then the headers, and the Vary key they give */
+	struct reqhdrs h = {buf, 0, 0, 0};
+	if (read_requesthdrs(&rio, &h) < 0) {
+		return 0;
+	}
+	if (h.len >= HDR_MAXSIZE) {
+		abort();
+	}
+	size_t names_len;
+	const char *names = find_hdr(h.buf, h.len, "Vary", &names_len);
+	if (names != NULL) {
+		if (names < h.buf || names + names_len > h.buf + h.len) {
+			abort();
+		}
+		vary_key(vkey, MAXLINE, key, names, names_len, &h);
+	}
+	return 0;
+}
+
+#ifdef LIBFUZZER
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+	fuzz_setup();
+	return 0;
+}
+#else
+/* Seeds for the built-in mutator */
+static const char *seeds[] = {
+    "GET http://www.example.com/index.html HTTP/1.0\r\n"
+    "Host: www.example.com\r\n\r\n",
+    "GET http://user@[::1]:8080/a/./b/../%7ec?utm_x=1&b=2&a=1#f HTTP/1.1\r\n"
+    "Accept-Encoding: gzip\r\nVary: Accept-Encoding, *\r\n"
+    "User-Agent: x\r\nProxy-Connection: keep-alive\r\n\r\n",
+    "GET https://EXAMPLE.com:443/%2e%2E/x//y?c=&c HTTP/1.1\n"
+    "X-Fun-King-Peer: a\nHost: example.com\nVary: host, accept\n\n",
+    "CONNECT example.com:443 HTTP/1.1\r\n\r\n",
+};
+#define NSEEDS (sizeof seeds / sizeof seeds[0])
+
+/*
+ * mutate - apply a few random byte flips, insertions, deletions and
+ *     splices of interesting tokens to the size bytes at buf, which has
+ *     room for cap. Returns the new size.
+ */
+static size_t mutate(char *buf, size_t size, size_t cap, unsigned *seed)
+{
+	static const char *tokens[] = {
+	    "\r\n", "\n", " ", ":", "/", "//", "/../", "/./", "%", "%2", "%zz",
+	    "?", "&", "=", "#", "[", "]", "@", "http://", "https://", ":80",
+	    "Vary: ", "Host: ", "*", ",", "\t", "\0",
+	};
+	const int ntokens = sizeof tokens / sizeof tokens[0];
+
+	for (int m = rand_r(seed) % 8 + 1; m > 0; --m) {
+		const size_t pos = size ? rand_r(seed) % (size + 1) : 0;
+		switch (rand_r(seed) % 4) {
+		case 0: /* Flip a byte */
+			if (pos < size) {
+				buf[pos] ^= 1 << (rand_r(seed) % 8);
+			}
+			break;
+		case 1: /* Insert a random byte */
+			if (size < cap) {
+				memmove(buf + pos + 1, buf + pos, size - pos);
+				buf[pos] = rand_r(seed);
+				++size;
+			}
+			break;
+		case 2: { /* Delete a run */
+			const size_t n = rand_r(seed) % 16;
+			if (pos + n <= size) {
+				memmove(buf + pos, buf + pos + n,
+					size - pos - n);
+				size -= n;
+			}
+			break;
+		}
+		default: { /* Insert a token, sometimes many times */
+			const char *t = tokens[rand_r(seed) % ntokens];
+			const size_t len = *t ? strlen(t) : 1;
+			for (int r = rand_r(seed) % 4 ? 1 : 512;
+			     r > 0 && size + len <= cap; --r) {
+				memmove(buf + pos + len, buf + pos, size - pos);
+				memcpy(buf + pos, t, len);
+				size += len;
+			}
+		}
+		}
+	}
+	return size;
+}
+
+static void run_file(const char *path)
+{
+	static char buf[FUZZ_MAXINPUT + 1];
+	FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+	if (fp == NULL) {
+		unix_error((char *)path);
+	}
+	const size_t n = fread(buf, 1, sizeof buf, fp);
+	if (fp != stdin) {
+		fclose(fp);
+	}
+	LLVMFuzzerTestOneInput((const uint8_t *)buf, n);
+}
+
+int main(int argc, char **argv)
+{
+	long iters = 100000;
+	unsigned seed = time(NULL);
+	int opt;
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iters = atol(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr,
+				"usage: %s [-n iterations] [-s seed] "
+				"[file...]\n",
+				argv[0]);
+			exit(1);
+		}
+	}
+
+	fuzz_setup();
+	if (optind < argc) {
+		for (int i = optind; i < argc; ++i) {
+			run_file(argv[i]);
+		}
+		return 0;
+	}
+
+	/* Report the seed first, so a crash can be reproduced */
+	fprintf(stderr, "fuzzing %ld inputs with seed %u\n", iters, seed);
+	static char buf[FUZZ_MAXINPUT];
+	for (long i = 0; i < iters; ++i) {
+		const char *s = seeds[rand_r(&seed) % NSEEDS];
+		size_t size = strlen(s);
+		memcpy(buf, s, size);
+		size = mutate(buf, size, sizeof buf, &seed);
+		LLVMFuzzerTestOneInput((const uint8_t *)buf, size);
+	}
+	fprintf(stderr, "done\n");
+	return 0;
+}
+#endif /* LIBFUZZER */
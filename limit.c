@@ -0,0 +1,321 @@
+/****************************************************************
+ * Per-client accounting: connection and request-rate limits,
+ * per-upstream connection limits, and fair admission of the
+ * connections waiting while the proxy is saturated
+ ****************************************************************/
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "limit.h"
+#include "rio.h"
+#include "utils.h"
+
+#define LIMIT_BUCKETS 1024 /* Hash buckets for clients and end servers */
+#define LIMIT_SWEEP 10000  /* ms between sweeps of idle clients */
+
+/* A connection waiting for admission */
+struct waiter {
+	int fd;
+	struct waiter *next;
+};
+
+struct client {
+	char addr[NI_MAXHOST];
+	int conns;		     /* Connections admitted or waiting */
+	struct waiter *head, *tail;  /* Connections waiting, oldest first */
+	struct client *next_waiting; /* In the round of waiting clients */
+	long long tokens;	     /* Requests it may make, in 1/1000ths */
+	long long refilled;	     /* rio_now() the tokens were counted */
+	struct client *next;	     /* In its hash bucket */
+};
+
+struct host {
+	char name[NI_MAXHOST];
+	int conns;
+	struct host *next;
+};
+
+static struct limits lim;
+static struct client *clients[LIMIT_BUCKETS];
+static struct host *hosts[LIMIT_BUCKETS];
+static struct client *waiting, *waiting_tail; /* Clients with waiters */
+static int running, queued;		      /* Connections */
+static long long swept;
+static pthread_mutex_t limit_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned hash(const char *s)
+{
+	unsigned h = 5381;
+	while (*s)
+		h = h * 33 + tolower((unsigned char)*s++);
+	return h % LIMIT_BUCKETS;
+}
+
+/*
+ * limit_init - set the limits, before any connection is accepted
+ */
+void limit_init(const struct limits *l)
+{
+	lim = *l;
+	if (lim.rate > 0 && lim.burst < 1) {
+		lim.burst = 1;
+	}
+}
+
+/*
+ * refill - add the tokens c has earned since they were last counted
+ */
+static void refill(struct client *c, long long now)
+{
+	const long long full = lim.burst * 1000LL;
+	c->tokens += (now - c->refilled) * lim.rate;
+	if (c->tokens > full) {
+		c->tokens = full;
+	}
+	c->refilled = now;
+}
+
+/*
+ * find_client - the entry for addr, made if create is set. Called with
+ *     limit_mutex held.
+ */
+static struct client *find_client(const char *addr, int create)
+{
+	struct client **pp = &clients[hash(addr)];
+	for (; *pp != NULL; pp = &(*pp)->next) {
+		if (strcmp((*pp)->addr, addr) == 0) {
+			return *pp;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	struct client *c = calloc(1, sizeof *c);
+	if (c == NULL) {
+		msg_unix_error("calloc");
+		return NULL;
+	}
+	snprintf(c->addr, sizeof c->addr, "%s", addr);
+	c->tokens = lim.burst * 1000LL;
+	c->refilled = rio_now();
+	*pp = c;
+	return c;
+}
+
+/*
+ * sweep - free the entries of clients with no connections whose tokens
+ *     have refilled, as a new entry would have as many. Called with
+ *     limit_mutex held.
+ */
+static void sweep(long long now)
+{
+	swept = now;
+	for (int i = 0; i < LIMIT_BUCKETS; ++i) {
+		for (struct client **pp = &clients[i]; *pp != NULL;) {
+			struct client *c = *pp;
+			if (lim.rate > 0) {
+				refill(c, now);
+			}
+			const int full = c->tokens == lim.burst * 1000LL;
+			if (c->conns == 0 && (lim.rate == 0 || full)) {
+				*pp = c->next;
+				free(c);
+			} else {
+				pp = &c->next;
+			}
+		}
+	}
+}
+
+/*
+ * limit_admit - account for a new connection fd from client, which is
+ *     held to client_conns unless exempt. Returns LIMIT_RUN if it can be
+ *     served now, or LIMIT_QUEUED if it is to wait for a connection being
+ *     served to finish, as max_conns are. Returns LIMIT_CLIENT or LIMIT_FULL
+ *     if it is to be turned away instead.
+ */
+int limit_admit(int fd, const char *client, int exempt)
+{
+	int rc = LIMIT_RUN;
+
+	pthread_mutex_lock(&limit_mutex);
+	const long long now = rio_now();
+	if (now - swept > LIMIT_SWEEP) {
+		sweep(now);
+	}
+
+	struct client *c = find_client(client, 1);
+	if (c == NULL) {
+		rc = LIMIT_FULL;
+	} else if (!exempt && lim.client_conns > 0 &&
+		   c->conns >= lim.client_conns) {
+		rc = LIMIT_CLIENT;
+	} else if (lim.max_conns == 0 || running < lim.max_conns) {
+		++c->conns;
+		++running;
+	} else if (queued >= lim.max_queued) {
+		rc = LIMIT_FULL;
+	} else {
+		struct waiter *w = malloc(sizeof *w);
+		if (w == NULL) {
+			msg_unix_error("malloc");
+			rc = LIMIT_FULL;
+			goto out;
+		}
+		w->fd = fd;
+		w->next = NULL;
+		if (c->head == NULL) {
+			/* Join the round at the back */
+			c->head = w;
+			c->next_waiting = NULL;
+			if (waiting == NULL) {
+				waiting = c;
+			} else {
+				waiting_tail->next_waiting = c;
+			}
+			waiting_tail = c;
+		} else {
+			c->tail->next = w;
+		}
+		c->tail = w;
+		++c->conns;
+		++queued;
+		rc = LIMIT_QUEUED;
+	}
+
+out:
+	pthread_mutex_unlock(&limit_mutex);
+	return rc;
+}
+
+/*
+ * limit_done - account for the end of a connection from client, and hand
+ *     out the next waiting one. The clients with connections waiting take
+ *     turns, so one with many cannot crowd out the rest. Returns its
+ *     descriptor, with its client's address copied to client (NI_MAXHOST
+ *     bytes), or -1 if none is waiting.
+ */
+int limit_done(char *client)
+{
+	int fd = -1;
+
+	pthread_mutex_lock(&limit_mutex);
+	struct client *c = find_client(client, 0);
+	if (c != NULL) {
+		--c->conns;
+	}
+	--running;
+
+	if (waiting != NULL) {
+		c = waiting;
+		struct waiter *w = c->head;
+		fd = w->fd;
+		if ((c->head = w->next) == NULL) {
+			c->tail = NULL;
+		}
+		free(w);
+		--queued;
+		++running;
+
+		/* To the back of the round if it has more waiting */
+		waiting = c->next_waiting;
+		if (waiting == NULL) {
+			waiting_tail = NULL;
+		}
+		if (c->head != NULL) {
+			c->next_waiting = NULL;
+			if (waiting == NULL) {
+				waiting = c;
+			} else {
+				waiting_tail->next_waiting = c;
+			}
+			waiting_tail = c;
+		}
+		strcpy(client, c->addr);
+	}
+	pthread_mutex_unlock(&limit_mutex);
+
+	return fd;
+}
+
+/*
+ * limit_request - take a token from client's bucket for a request. Returns
+ *     -1 if it is empty.
+ */
+int limit_request(const char *client)
+{
+	int rc = 0;
+
+	if (lim.rate == 0) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&limit_mutex);
+	struct client *c = find_client(client, 1);
+	if (c != NULL) {
+		refill(c, rio_now());
+		if (c->tokens < 1000) {
+			rc = -1;
+		} else {
+			c->tokens -= 1000;
+		}
+	}
+	pthread_mutex_unlock(&limit_mutex);
+
+	return rc;
+}
+
+/*
+ * limit_host_enter - account for a connection to the end server host.
+ *     Returns -1 if it already has host_conns.
+ */
+int limit_host_enter(const char *host)
+{
+	int rc = -1;
+
+	if (lim.host_conns == 0) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&limit_mutex);
+	struct host **pp = &hosts[hash(host)];
+	while (*pp != NULL && strcasecmp((*pp)->name, host) != 0)
+		pp = &(*pp)->next;
+	if (*pp == NULL && (*pp = calloc(1, sizeof **pp)) != NULL) {
+		snprintf((*pp)->name, sizeof (*pp)->name, "%s", host);
+	}
+	if (*pp != NULL && (*pp)->conns < lim.host_conns) {
+		++(*pp)->conns;
+		rc = 0;
+	}
+	pthread_mutex_unlock(&limit_mutex);
+
+	return rc;
+}
+
+/*
+ * limit_host_exit - account for the end of a connection to host
+ */
+void limit_host_exit(const char *host)
+{
+	if (lim.host_conns == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&limit_mutex);
+	struct host **pp = &hosts[hash(host)];
+	while (*pp != NULL && strcasecmp((*pp)->name, host) != 0)
+		pp = &(*pp)->next;
+	if (*pp != NULL && --(*pp)->conns == 0) {
+		struct host *h = *pp;
+		*pp = h->next;
+		free(h);
+	}
+	pthread_mutex_unlock(&limit_mutex);
+}
@@ -0,0 +1,29 @@
+#ifndef __LIMIT_H__
+#define __LIMIT_H__
+
+#include <netdb.h>
+
+/* Per-client and per-upstream limits; 0 leaves one off */
+struct limits {
+	int client_conns; /* Connections one client may have open */
+	int host_conns;	  /* Connections to one end server at a time */
+	int rate;	  /* Requests per second a client may make... */
+	int burst;	  /* ...after a burst of this many */
+	int max_conns;	  /* Connections served at once; others wait */
+	int max_queued;	  /* Connections that may wait */
+};
+
+/* What limit_admit() did with a new connection */
+#define LIMIT_RUN 0	/* Serve it now */
+#define LIMIT_QUEUED 1	/* It waits for limit_done() to hand it out */
+#define LIMIT_CLIENT -1 /* Its client has too many connections */
+#define LIMIT_FULL -2	/* Too many connections are waiting */
+
+void limit_init(const struct limits *l);
+int limit_admit(int fd, const char *client, int exempt);
+int limit_done(char *client);
+int limit_request(const char *client);
+int limit_host_enter(const char *host);
+void limit_host_exit(const char *host);
+
+#endif /* __LIMIT_H__ */
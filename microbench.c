@@ -0,0 +1,441 @@
+/*
+ * microbench.c - per-component benchmarks for the proxy: URI parsing, the
+ *     request line and header reader, the cache and the relay loop.
+ *
+ *     Reports ns/op and allocations/op (counted by wrapping malloc, see the
+ *     Makefile), the cache's throughput as threads are added, and how the
+ *     cache sits in memory with the TLB misses and remote NUMA loads its
+ *     benchmarks took, where the hardware counts them. The
+ *     proxy's own logging on stdout is discarded; results go to stderr.
+ *
+ *     usage: ./ubench [-t max_threads] [filter]
+ */
+
+/* The proxy is built in, so its static parsers and relay can be measured
+ * as they are */
+#define main proxy_main
+#include "proxy.c"
+#undef main
+
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#define BENCH_MINTIME 200000000LL /* ns each benchmark runs for, at least */
+#define SCALE_OPS 200000	  /* Cache operations per thread */
+#define RELAY_BYTES (64 << 20)	  /* Bytes pushed through each relay run */
+
+static atomic_long nallocs; /* Calls to malloc, calloc and realloc */
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	atomic_fetch_add_explicit(&nallocs, 1, memory_order_relaxed);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	atomic_fetch_add_explicit(&nallocs, 1, memory_order_relaxed);
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	atomic_fetch_add_explicit(&nallocs, 1, memory_order_relaxed);
+	return __real_realloc(ptr, size);
+}
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static const char *filter; /* Only run benchmarks whose names contain it */
+static volatile size_t sink; /* Keeps results from being optimized away */
+
+/*
+ * bench - time fn, doubling its iteration count until it runs for
+ *     BENCH_MINTIME, and report the cost of one iteration
+ */
+static void bench(const char *name, void (*fn)(long iters))
+{
+	if (filter != NULL && strstr(name, filter) == NULL) {
+		return;
+	}
+
+	long iters = 1;
+	long long elapsed;
+	long allocs;
+	while (1) {
+		const long a0 = atomic_load(&nallocs);
+		const long long t0 = now_ns();
+		fn(iters);
+		elapsed = now_ns() - t0;
+		allocs = atomic_load(&nallocs) - a0;
+		if (elapsed >= BENCH_MINTIME || iters >= 1L << 30) {
+			break;
+		}
+		iters *= 2;
+	}
+	fprintf(stderr, "%-32s %12.1f ns/op %8.2f allocs/op\n", name,
+		(double)elapsed / iters, (double)allocs / iters);
+}
+
+/* Request URIs of assorted shapes */
+static const char *uris[] = {
+    "http://www.example.com/",
+    "http://www.example.com:8080/index.html",
+    "http://user@example.com/a/./b/../c/%7euser/file.txt?q=1&a=2#frag",
+    "http://[2001:db8::1]:8080/search?utm_source=x&q=proxy&lang=en",
+    "https://cdn.example.net/static/js/app.0123456789abcdef.min.js",
+    "http://Example.COM/very/long/path/with/many/segments/to/walk/over/"
+    "and/normalize/on/the/way/index.html?b=2&a=1&c=3&d=4",
+};
+#define NURIS (sizeof uris / sizeof uris[0])
+
+static void b_parse_uri(long iters)
+{
+	struct uri u;
+	for (long i = 0; i < iters; ++i) {
+		parse_uri(uris[i % NURIS], &u);
+		sink += u.path_len;
+	}
+}
+
+static void b_canon_uri(long iters)
+{
+	char key[MAXLINE];
+	for (long i = 0; i < iters; ++i) {
+		canon_uri(uris[i % NURIS], key, sizeof key);
+		sink += key[0];
+	}
+}
+
+static void b_parse_requestline(long iters)
+{
+	static const char req[] =
+	    "GET http://www.example.com/index.html?q=1 HTTP/1.1\r\n";
+	char line[sizeof req];
+	char *method, *uri, *version;
+	for (long i = 0; i < iters; ++i) {
+		memcpy(line, req, sizeof req);
+		parse_requestline(line, &method, &uri, &version);
+		sink += *version;
+	}
+}
+
+/* A browser-like header block, and the request line in front of it */
+static const char hdr_block[] =
+    "GET http://www.example.com/index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 "
+    "Firefox/115.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: http://www.example.com/\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark; "
+    "consent=yes\r\n"
+    "Connection: keep-alive\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+/*
+ * load_rio - make rp read the bytes at buf, as if they had just arrived on
+ *     a connection
+ */
+static void load_rio(rio_t *rp, const char *buf, size_t n)
+{
+	rio_readinitb(rp, -1);
+	memcpy(rp->rio_buf, buf, n);
+	rp->rio_cnt = n;
+}
+
+static void b_rio_readlineb(long iters)
+{
+	static rio_t rio;
+	char line[MAXLINE];
+	for (long i = 0; i < iters; ++i) {
+		load_rio(&rio, hdr_block, sizeof hdr_block - 1);
+		ssize_t n;
+		while ((n = rio_readlineb(&rio, line, sizeof line)) > 2)
+			sink += n;
+	}
+}
+
+static void b_read_requesthdrs(long iters)
+{
+	static rio_t rio;
+	static char buf[HDR_MAXSIZE], line[MAXLINE];
+	for (long i = 0; i < iters; ++i) {
+		struct reqhdrs h = {buf, 0, 0, 0};
+		load_rio(&rio, hdr_block, sizeof hdr_block - 1);
+		rio_readlineb(&rio, line, sizeof line);
+		read_requesthdrs(&rio, &h);
+		sink += h.len;
+	}
+}
+
+static void b_find_hdr(long iters)
+{
+	const char *hdrs = strchr(hdr_block, '\n') + 1;
+	const size_t len = sizeof hdr_block - 1 - (hdrs - hdr_block);
+	size_t vlen;
+	for (long i = 0; i < iters; ++i) {
+		sink += find_hdr(hdrs, len, "Cache-Control", &vlen) != NULL;
+	}
+}
+
+#define NKEYS 1024		/* Distinct keys the cache benchmarks use */
+#define ITEM_SIZE 512		/* Small enough for all NKEYS to fit */
+#define EVICT_SIZE (32 * 1024)	/* Large enough to force eviction */
+static char keys[NKEYS][64];
+static char item_buf[EVICT_SIZE];
+
+static void b_get_cache(long iters)
+{
+	void *item;
+	size_t size;
+	for (long i = 0; i < iters; ++i) {
+		if (get_cache(&cache, keys[i % NKEYS], &item, &size) == 0) {
+			sink += size;
+			free(item);
+		}
+	}
+}
+
+static void b_get_cache_miss(long iters)
+{
+	void *item;
+	size_t size;
+	for (long i = 0; i < iters; ++i) {
+		sink += get_cache(&cache, "http://nowhere.example/", &item,
+				  &size);
+	}
+}
+
+static void b_put_cache(long iters)
+{
+	for (long i = 0; i < iters; ++i) {
+		put_cache(&cache, keys[i % NKEYS], item_buf, ITEM_SIZE);
+	}
+}
+
+static void b_put_cache_evict(long iters)
+{
+	for (long i = 0; i < iters; ++i) {
+		put_cache(&cache, keys[i % NKEYS], item_buf, EVICT_SIZE);
+	}
+}
+
+static void b_purge_cache(long iters)
+{
+	for (long i = 0; i < iters; ++i) {
+		put_cache(&cache, keys[i % NKEYS], item_buf, ITEM_SIZE);
+		sink += purge_cache(&cache, keys[i % NKEYS], 1);
+	}
+}
+
+static void fill_cache(void)
+{
+	for (int i = 0; i < NKEYS; ++i) {
+		put_cache(&cache, keys[i], item_buf, ITEM_SIZE);
+	}
+}
+
+/* Each scaling thread does SCALE_OPS operations, one in ten a put */
+static void *scale_thread(void *vargp)
+{
+	unsigned seed = (unsigned)(size_t)vargp;
+	void *item;
+	size_t size;
+
+	for (int i = 0; i < SCALE_OPS; ++i) {
+		const char *key = keys[rand_r(&seed) % NKEYS];
+		if (rand_r(&seed) % 10 == 0) {
+			put_cache(&cache, key, item_buf, ITEM_SIZE);
+		} else if (get_cache(&cache, key, &item, &size) == 0) {
+			free(item);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * scale_cache - cache throughput with 1, 2, 4, ... max_threads threads
+ *     mixing gets and puts over the same keys
+ */
+static void scale_cache(int max_threads)
+{
+	if (filter != NULL && strstr("cache_scaling", filter) == NULL) {
+		return;
+	}
+
+	pthread_t tids[max_threads];
+	double base = 0;
+	fill_cache();
+	for (int n = 1; n <= max_threads; n *= 2) {
+		const long long t0 = now_ns();
+		for (int i = 0; i < n; ++i) {
+			pthread_create(&tids[i], NULL, scale_thread,
+				       (void *)(size_t)(i + 1));
+		}
+		for (int i = 0; i < n; ++i) {
+			pthread_join(tids[i], NULL);
+		}
+		const double mops =
+		    (double)n * SCALE_OPS / (now_ns() - t0) * 1000;
+		if (n == 1) {
+			base = mops;
+		}
+		fprintf(stderr,
+			"cache_scaling/%-2d threads        "
+			"%12.2f Mops/s %8.2fx\n",
+			n, mops, mops / base);
+	}
+}
+
+/*
+ * report_memory - how the cache is backed, and the hardware counts since
+ *     before, as the cache benchmarks left them
+ */
+static void report_memory(const struct pmu_counts *before)
+{
+	static const char *backings[] = {"4k", "thp", "hugetlb"};
+	struct cache_stats st;
+	struct pmu_counts after;
+
+	if (filter != NULL && strstr("cache_memory", filter) == NULL) {
+		return;
+	}
+	cache_stats(&cache, &st);
+	pmu_read(&after);
+	fprintf(stderr,
+		"%-32s %s, %zu of %zu bytes on huge pages\n", "cache_memory",
+		backings[st.backing], st.huge, st.mapped);
+	if (after.dtlb_misses < 0 || after.remote_loads < 0) {
+		fprintf(stderr, "%-32s n/a\n", "cache_memory/counters");
+		return;
+	}
+	fprintf(stderr, "%-32s %lld dTLB load misses, %lld remote loads\n",
+		"cache_memory/counters",
+		after.dtlb_misses - before->dtlb_misses,
+		after.remote_loads - before->remote_loads);
+}
+
+/* The relay benchmark's end server and client ends */
+static void *relay_source(void *vargp)
+{
+	const int fd = *(int *)vargp;
+	static char buf[65536];
+	for (size_t sent = 0; sent < RELAY_BYTES; sent += sizeof buf) {
+		if (rio_writen(fd, buf, sizeof buf) != sizeof buf) {
+			break;
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+static void *relay_sink(void *vargp)
+{
+	const int fd = *(int *)vargp;
+	static char buf[65536];
+	ssize_t n;
+	while ((n = read(fd, buf, sizeof buf)) > 0)
+		sink += n;
+	close(fd);
+	return NULL;
+}
+
+/*
+ * b_relay - push RELAY_BYTES through relay() per iteration, between two
+ *     socket pairs standing in for the end server and the client
+ */
+static void b_relay(long iters)
+{
+	for (long i = 0; i < iters; ++i) {
+		int src[2], dst[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, src) < 0 ||
+		    socketpair(AF_UNIX, SOCK_STREAM, 0, dst) < 0) {
+			unix_error("socketpair");
+		}
+
+		pthread_t tsrc, tdst;
+		pthread_create(&tsrc, NULL, relay_source, &src[1]);
+		pthread_create(&tdst, NULL, relay_sink, &dst[1]);
+		struct fill f = {NULL, 0, 0, 0};
+		relay(src[0], dst[0], 0, &f);
+		free(f.item);
+		close(src[0]);
+		close(dst[0]);
+		pthread_join(tsrc, NULL);
+		pthread_join(tdst, NULL);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int opt, max_threads = 8;
+	while ((opt = getopt(argc, argv, "t:")) != -1) {
+		switch (opt) {
+		case 't':
+			max_threads = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t max_threads] [filter]\n",
+				argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc) {
+		filter = argv[optind];
+	}
+	if (max_threads < 1) {
+		max_threads = 1;
+	}
+
+	if (freopen("/dev/null", "w", stdout) == NULL) {
+		unix_error("freopen");
+	}
+	signal(SIGPIPE, SIG_IGN);
+	cache = Make_cache(NULL);
+	pmu_init();
+	Init_pool(&riopool, RIO_OBJSIZE, POOL_MAXFREE);
+	Init_pool(&linepool, MAXLINE, POOL_MAXFREE);
+	Init_pool(&hdrpool, HDR_MAXSIZE, POOL_MAXFREE);
+	Init_pool(&relaypool, conf.relay_bufsize, RELAY_MAXFREE);
+	for (int i = 0; i < NKEYS; ++i) {
+		snprintf(keys[i], sizeof keys[i],
+			 "http://www.example.com:80/objects/%d", i);
+	}
+
+	bench("parse_uri", b_parse_uri);
+	bench("canon_uri", b_canon_uri);
+	bench("parse_requestline", b_parse_requestline);
+	bench("rio_readlineb/header_block", b_rio_readlineb);
+	bench("read_requesthdrs", b_read_requesthdrs);
+	bench("find_hdr", b_find_hdr);
+
+	struct pmu_counts pc;
+	pmu_read(&pc);
+	fill_cache();
+	bench("get_cache/hit", b_get_cache);
+	bench("get_cache/miss", b_get_cache_miss);
+	bench("put_cache/replace", b_put_cache);
+	bench("put_cache/evict", b_put_cache_evict);
+	bench("put_cache+purge_cache/exact", b_purge_cache);
+	scale_cache(max_threads);
+	report_memory(&pc);
+
+	bench("relay/64MiB", b_relay);
+	return 0;
+}
@@ -0,0 +1,331 @@
+/****************************************************************
+ * Sibling cache cluster: consistent hashing of cache keys onto
+ * peer proxies, and persistent connections to them
+ ****************************************************************/
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "peer.h"
+#include "utils.h"
+
+#define PEER_VNODES 128	 /* Virtual nodes per unit of weight */
+#define PEER_MAXIDLE 8	 /* Idle connections kept per peer */
+#define PEER_CONN_DELAY 250 /* Happy Eyeballs delay for peers */
+#define PEER_MAXADDRS 8	    /* Addresses a peer's host is known by */
+
+struct node {
+	struct peer peer;
+	char addrs[PEER_MAXADDRS][NI_MAXHOST]; /* Its host's, numeric */
+	int naddrs;
+	int idle[PEER_MAXIDLE]; /* Connections ready for another request */
+	int nidle;
+};
+
+struct vnode {
+	uint64_t hash;
+	int node;
+};
+
+/* The current membership; replaced as a whole by peer_load() */
+static struct node *nodes;
+static int nnodes;
+static struct vnode *ring;
+static int nring;
+static int self = -1; /* This proxy's node, -1 if not a member */
+static char self_name[sizeof nodes->peer.name];
+static pthread_rwlock_t ring_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * hash64 - FNV-1a, finished with a 64-bit mixer so that similar keys and
+ *     virtual node names spread over the whole ring
+ */
+static uint64_t hash64(const char *s, size_t n)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (size_t i = 0; i < n; ++i) {
+		h ^= (unsigned char)s[i];
+		h *= 0x100000001b3ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static int cmp_vnode(const void *a, const void *b)
+{
+	const struct vnode *x = a, *y = b;
+	return (x->hash > y->hash) - (x->hash < y->hash);
+}
+
+/*
+ * resolve - look up the numeric addresses of n's host, which is how a
+ *     request from it will name it. Returns -1 if there are none.
+ */
+static int resolve(struct node *n)
+{
+	struct addrinfo hints, *list;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_socktype = SOCK_STREAM;
+	const int rc = getaddrinfo(n->peer.host, NULL, &hints, &list);
+	if (rc != 0) {
+		msg_gai_error(rc, "peer_load: getaddrinfo");
+		return -1;
+	}
+
+	n->naddrs = 0;
+	for (struct addrinfo *p = list; p && n->naddrs < PEER_MAXADDRS;
+	     p = p->ai_next) {
+		char *addr = n->addrs[n->naddrs];
+		if (getnameinfo(p->ai_addr, p->ai_addrlen, addr, NI_MAXHOST,
+				NULL, 0, NI_NUMERICHOST) != 0) {
+			continue;
+		}
+		int dup = 0;
+		for (int i = 0; i < n->naddrs && !dup; ++i) {
+			dup = strcmp(n->addrs[i], addr) == 0;
+		}
+		n->naddrs += !dup;
+	}
+	freeaddrinfo(list);
+	return n->naddrs > 0 ? 0 : -1;
+}
+
+/*
+ * peer_load - (re)load the membership from the config at path, whose lines
+ *     read "<name> <host> <port> [<weight>]" ('#' starts a comment). self
+ *     names this proxy's own line. Host names are resolved here, and again
+ *     only on the next load. On error, the old membership is kept.
+ */
+int peer_load(const char *path, const char *self_id)
+{
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		msg_unix_error("peer_load: fopen");
+		return -1;
+	}
+
+	struct node *new_nodes = NULL;
+	struct vnode *new_ring = NULL;
+	int new_nnodes = 0, new_nring = 0, new_self = -1, lineno = 0;
+	char line[1024];
+
+	while (fgets(line, sizeof line, fp) != NULL) {
+		++lineno;
+		line[strcspn(line, "#\n")] = '\0';
+
+		struct peer p;
+		int weight = 1, n;
+		n = sscanf(line, "%63s %1024s %31s %d", p.name, p.host,
+			   p.service, &weight);
+		if (n <= 0) {
+			continue; /* Blank */
+		}
+		if (n < 3 || weight < 1 || weight > 100) {
+			fprintf(stderr, "peer_load: %s:%d: bad line\n", path,
+				lineno);
+			goto err;
+		}
+
+		void *grown = realloc(new_nodes,
+				      (new_nnodes + 1) * sizeof *new_nodes);
+		if (grown == NULL) {
+			goto malloc_err;
+		}
+		new_nodes = grown;
+		grown = realloc(new_ring, (new_nring + weight * PEER_VNODES) *
+					      sizeof *new_ring);
+		if (grown == NULL) {
+			goto malloc_err;
+		}
+		new_ring = grown;
+
+		new_nodes[new_nnodes].peer = p;
+		new_nodes[new_nnodes].nidle = 0;
+		if (resolve(&new_nodes[new_nnodes]) < 0) {
+			fprintf(stderr, "peer_load: %s:%d: cannot resolve %s\n",
+				path, lineno, p.host);
+			goto err;
+		}
+		if (strcmp(p.name, self_id) == 0) {
+			new_self = new_nnodes;
+		}
+
+		/* Each virtual node sits at the hash of "<name>#<i>" */
+		for (int i = 0; i < weight * PEER_VNODES; ++i) {
+			char vname[sizeof p.name + 16];
+			const int len = snprintf(vname, sizeof vname, "%s#%d",
+						 p.name, i);
+			new_ring[new_nring].hash = hash64(vname, len);
+			new_ring[new_nring++].node = new_nnodes;
+		}
+		++new_nnodes;
+	}
+	fclose(fp);
+	fp = NULL;
+	qsort(new_ring, new_nring, sizeof *new_ring, cmp_vnode);
+
+	/* Swap in the new membership; idle connections go with the old */
+	pthread_rwlock_wrlock(&ring_lock);
+	pthread_mutex_lock(&idle_mutex);
+	struct node *old_nodes = nodes;
+	const int old_nnodes = nnodes;
+	struct vnode *old_ring = ring;
+	nodes = new_nodes;
+	nnodes = new_nnodes;
+	ring = new_ring;
+	nring = new_nring;
+	self = new_self;
+	snprintf(self_name, sizeof self_name, "%s", self_id);
+	pthread_mutex_unlock(&idle_mutex);
+	pthread_rwlock_unlock(&ring_lock);
+
+	for (int i = 0; i < old_nnodes; ++i) {
+		for (int j = 0; j < old_nodes[i].nidle; ++j) {
+			close(old_nodes[i].idle[j]);
+		}
+	}
+	free(old_nodes);
+	free(old_ring);
+
+	printf("Loaded %d peers from %s%s\n", new_nnodes, path,
+	       new_self < 0 ? " (not including this proxy)" : "");
+	return 0;
+
+malloc_err:
+	msg_unix_error("realloc");
+err:
+	if (fp != NULL) {
+		fclose(fp);
+	}
+	free(new_nodes);
+	free(new_ring);
+	return -1;
+}
+
+/*
+ * peer_owner - find the peer owning key: the first virtual node at or after
+ *     the key's hash on the ring. Returns 1 and copies it to *owner if that
+ *     is another proxy, 0 if it is this one or there are no peers.
+ */
+int peer_owner(const char *key, struct peer *owner)
+{
+	const uint64_t h = hash64(key, strlen(key));
+	int rc = 0;
+
+	pthread_rwlock_rdlock(&ring_lock);
+	if (nring > 0) {
+		int lo = 0, hi = nring;
+		while (lo < hi) {
+			const int mid = lo + (hi - lo) / 2;
+			if (ring[mid].hash < h) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		const int node = ring[lo == nring ? 0 : lo].node;
+		if (node != self) {
+			*owner = nodes[node].peer;
+			rc = 1;
+		}
+	}
+	pthread_rwlock_unlock(&ring_lock);
+
+	return rc;
+}
+
+/*
+ * peer_self - this proxy's name among its peers
+ */
+const char *peer_self(void)
+{
+	return self_name;
+}
+
+/*
+ * peer_known - whether the numeric address addr is one a peer's host
+ *     resolved to
+ */
+int peer_known(const char *addr)
+{
+	int rc = 0;
+
+	pthread_rwlock_rdlock(&ring_lock);
+	for (int i = 0; i < nnodes && !rc; ++i) {
+		for (int j = 0; j < nodes[i].naddrs && !rc; ++j) {
+			rc = strcmp(nodes[i].addrs[j], addr) == 0;
+		}
+	}
+	pthread_rwlock_unlock(&ring_lock);
+
+	return rc;
+}
+
+/*
+ * find_node - the current node for p, or NULL if it has since left.
+ *     Called with idle_mutex held.
+ */
+static struct node *find_node(const struct peer *p)
+{
+	for (int i = 0; i < nnodes; ++i) {
+		if (strcmp(nodes[i].peer.name, p->name) == 0 &&
+		    strcmp(nodes[i].peer.host, p->host) == 0 &&
+		    strcmp(nodes[i].peer.service, p->service) == 0) {
+			return &nodes[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * peer_get - a connection to p: an idle one if there is one (setting
+ *     *reused, as it may have been closed by p meanwhile), else a new one
+ *     made within timeout ms. Returns -1 on error.
+ */
+int peer_get(const struct peer *p, int timeout, int *reused)
+{
+	int fd = -1;
+
+	pthread_mutex_lock(&idle_mutex);
+	struct node *n = find_node(p);
+	if (n != NULL && n->nidle > 0) {
+		fd = n->idle[--n->nidle];
+	}
+	pthread_mutex_unlock(&idle_mutex);
+
+	if ((*reused = fd >= 0)) {
+		return fd;
+	}
+	return open_clientfd((char *)p->host, (char *)p->service, timeout,
+			     PEER_CONN_DELAY, 0);
+}
+
+/*
+ * peer_put - keep a connection to p, on which a response has been read in
+ *     full, for another request
+ */
+void peer_put(const struct peer *p, int fd)
+{
+	pthread_mutex_lock(&idle_mutex);
+	struct node *n = find_node(p);
+	if (n != NULL && n->nidle < PEER_MAXIDLE) {
+		n->idle[n->nidle++] = fd;
+		fd = -1;
+	}
+	pthread_mutex_unlock(&idle_mutex);
+
+	if (fd >= 0) {
+		close(fd);
+	}
+}
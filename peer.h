@@ -0,0 +1,22 @@
+#ifndef __PEER_H__
+#define __PEER_H__
+
+#include <netdb.h>
+
+#define PEER_HDR "X-Fun-King-Peer" /* Marks requests between siblings */
+
+/* A sibling proxy, as named in the peer config */
+struct peer {
+	char name[64];
+	char host[NI_MAXHOST];
+	char service[NI_MAXSERV];
+};
+
+int peer_load(const char *path, const char *self);
+int peer_owner(const char *key, struct peer *owner);
+const char *peer_self(void);
+int peer_known(const char *addr);
+int peer_get(const struct peer *p, int timeout, int *reused);
+void peer_put(const struct peer *p, int fd);
+
+#endif /* __PEER_H__ */
@@ -0,0 +1,64 @@
+/****************************************************************
+ * Hardware event counters for the proxy's threads, to see what
+ * the cache's memory layout costs in TLB misses and remote
+ * NUMA accesses
+ ****************************************************************/
+
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "pmu.h"
+
+#define CACHE_EVENT(cache) \
+	((cache) | PERF_COUNT_HW_CACHE_OP_READ << 8 | \
+	 PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+
+static int dtlb_fd = -1, node_fd = -1;
+
+/*
+ * open_counter - count the hardware cache event config in this process and
+ *     the threads it goes on to create, in user space. Returns -1 if it
+ *     cannot be counted here, as under most virtual machines.
+ */
+static int open_counter(unsigned long long config)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof attr);
+	attr.size = sizeof attr;
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = config;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * pmu_init - start counting, before any thread is created
+ */
+void pmu_init(void)
+{
+	dtlb_fd = open_counter(CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB));
+	node_fd = open_counter(CACHE_EVENT(PERF_COUNT_HW_CACHE_NODE));
+}
+
+static long long read_counter(int fd)
+{
+	long long n;
+	if (fd < 0 || read(fd, &n, sizeof n) != sizeof n) {
+		return -1;
+	}
+	return n;
+}
+
+/*
+ * pmu_read - the counts so far
+ */
+void pmu_read(struct pmu_counts *pc)
+{
+	pc->dtlb_misses = read_counter(dtlb_fd);
+	pc->remote_loads = read_counter(node_fd);
+}
@@ -0,0 +1,14 @@
+#ifndef __PMU_H__
+#define __PMU_H__
+
+/* Hardware event counts for the whole proxy; -1 where the CPU or the
+ * kernel will not count one */
+struct pmu_counts {
+	long long dtlb_misses;	/* data TLB misses on loads */
+	long long remote_loads; /* loads served from another NUMA node */
+};
+
+void pmu_init(void);
+void pmu_read(struct pmu_counts *pc);
+
+#endif /* __PMU_H__ */
@@ -0,0 +1,59 @@
+#include "pool.h"
+#include "utils.h"
+
+#define P(s) sem_wait(s)
+#define V(s) sem_post(s)
+
+void Init_pool(struct pool *pool, size_t size, int maxfree)
+{
+	if (sem_init(&pool->mutex, 0, 1) < 0) {
+		unix_error("sem_init");
+	}
+
+	pool->size = size < sizeof(void *) ? sizeof(void *) : size;
+	pool->nfree = 0;
+	pool->maxfree = maxfree;
+	pool->free = NULL;
+}
+
+/*
+ * pool_get - take a buffer off the free list, or malloc a new one when it
+ *     is empty. Returns NULL if malloc fails.
+ */
+void *pool_get(struct pool *pool)
+{
+	void *buf;
+
+	P(&pool->mutex);
+	if ((buf = pool->free) != NULL) {
+		pool->free = *(void **)buf;
+		--pool->nfree;
+	}
+	V(&pool->mutex);
+
+	if (buf == NULL && (buf = malloc(pool->size)) == NULL) {
+		msg_unix_error("malloc");
+	}
+	return buf;
+}
+
+/*
+ * pool_put - give a buffer from pool_get back for reuse. NULL is ignored.
+ */
+void pool_put(struct pool *pool, void *buf)
+{
+	if (buf == NULL) {
+		return;
+	}
+
+	P(&pool->mutex);
+	if (pool->nfree < pool->maxfree) {
+		*(void **)buf = pool->free;
+		pool->free = buf;
+		++pool->nfree;
+		buf = NULL;
+	}
+	V(&pool->mutex);
+
+	free(buf);
+}
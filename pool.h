@@ -0,0 +1,20 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <semaphore.h>
+#include <stdlib.h>
+
+/* A thread-safe free list of fixed-size buffers */
+struct pool {
+	size_t size;  /* size of each buffer */
+	int nfree;    /* buffers currently on the free list */
+	int maxfree;  /* buffers kept for reuse; the rest are freed */
+	void *free;   /* free list, linked through each buffer's first word */
+	sem_t mutex;
+};
+
+void Init_pool(struct pool *pool, size_t size, int maxfree);
+void *pool_get(struct pool *pool);
+void pool_put(struct pool *pool, void *buf);
+
+#endif /* __POOL_H__ */
@@ -1,16 +1,27 @@
 #define _BSD_SOURCE /* Get NI_MAXHOST & NI_MAXSERV from <netdb.h> */
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <netinet/in.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "cache.h"
+#include "limit.h"
+#include "peer.h"
+#include "pmu.h"
+#include "pool.h"
 #include "rio.h"
+#include "uri.h"
 #include "utils.h"
 
 /* Recommended max cache sizes */
@@ -18,352 +29,1650 @@
 #define MAXBUF 8192  /* Max I/O buffer size */
 #define ADDRSTRLEN (NI_MAXHOST + NI_MAXSERV + 10)
 
-#define RIO_WRITEN(FD, BUF, N)                                                 \
+#define THREAD_STACKSIZE (128 * 1024) /* Nothing big lives on the stack */
+#define POOL_MAXFREE 256	      /* Idle buffers kept in each pool */
+#define RELAY_MAXFREE 32	      /* ...but fewer of the big relay rings */
+#define ITEM_MINSIZE 8192	      /* First cache-fill buffer size */
+#define HDR_MAXSIZE 16384	      /* Max request header block size */
+#define UPGRADE_TAG 'U'		      /* Sent with the listener on handoff */
+#define UPGRADE_TIMEOUT 5000	      /* ms to wait for the handoff ack */
+#define PURGE_PATH "/purge"	      /* Admin URL, asked of the proxy itself */
+#define STATS_PATH "/stats"	      /* Likewise */
+#define REJECT_TIMEOUT 100	      /* ms to spend turning a client away */
+#define RIO_OBJSIZE                                                            \
+	(sizeof(rio_t) > sizeof(rio_out_t) ? sizeof(rio_t) : sizeof(rio_out_t))
+
+#define RIO_WRITEB(WP, BUF, N)                                                 \
 	do {                                                                   \
 		const size_t n = (N);                                          \
-		if (rio_writen(FD, BUF, n) != n) {                             \
-			msg_unix_error("rio_writen");                          \
+		if (rio_writeb(WP, BUF, n) != n) {                             \
+			msg_unix_error("rio_writeb");                          \
 			return -1;                                             \
 		};                                                             \
 	} while (0);
+#define RIO_PUTS(WP, STR) RIO_WRITEB(WP, STR, strlen(STR))
+
+/* Timeouts are in milliseconds, where -1 (0 for total) means no limit */
+struct conf {
+	int hdr_timeout;      /* Receiving the request line and headers */
+	int conn_timeout;     /* Connecting to the end server */
+	int conn_delay;	      /* Between staggered connection attempts */
+	int sockbuf;	      /* End server socket buffers, 0 for the default */
+	int idle_timeout;     /* Any single read or write making no progress */
+	int total_timeout;    /* The whole transaction */
+	size_t relay_bufsize; /* Response bytes held for a slow client */
+};
+
+/* Request headers to forward, read in full before the cache is consulted */
+struct reqhdrs {
+	char *buf;    /* Header lines, back to back */
+	size_t len;   /* Bytes of them in buf */
+	int host_fnd; /* Whether a Host header is among them */
+	int peer;     /* Whether a sibling proxy sent the request */
+};
+
+/* An accepted connection, for the thread serving it */
+struct conn {
+	int fd;
+	char client[NI_MAXHOST]; /* Numeric address of the client */
+};
 
-void forward(int confd);
-int clienterror(int fd, char *cause, char *errnum, char *shortmsg,
+/* A response being collected for the cache as it is relayed */
+struct fill {
+	char *item;  /* The response so far, malloc'ed */
+	size_t cap;  /* Bytes allocated for item */
+	size_t len;  /* Bytes relayed */
+	int collect; /* Whether the response may still be cached */
+};
+
+int forward(int confd, const char *client, rio_t *conrio, int first);
+int clienterror(rio_out_t *wp, char *cause, char *errnum, char *shortmsg,
 		char *longmsg);
-int forward_requesthdrs(rio_t *rp, int clifd, const char *host);
+int forward_requestline(rio_out_t *wp, const char *method,
+			const struct uri *u);
+int read_requesthdrs(rio_t *rp, struct reqhdrs *h);
+int forward_requesthdrs(rio_out_t *wp, const struct reqhdrs *h,
+			const char *host);
+ssize_t relay(int srcfd, int dstfd, long long deadline, struct fill *f);
+static ssize_t relay_chunked(int srcfd, rio_out_t *wp, long long deadline,
+			     struct fill *f, char *buf);
+static int fetch_peer(const struct peer *p, const char *uri,
+		      const struct reqhdrs *h, rio_out_t *wp,
+		      long long deadline, char *buf);
+static void fill_add(struct fill *f, const char *data, size_t n);
+static int purge(int confd, rio_t *rp, rio_out_t *wp, const char *method,
+		 const char *uri);
+static int stats(int confd, rio_t *rp, rio_out_t *wp, const char *uri);
+static int admin_request(int confd, rio_t *rp, rio_out_t *wp,
+			 const char *uri, char *buf);
+static int is_loopback(int fd);
+static int cacheable(const char *resp, size_t n);
+static int grow_item(char **item, size_t *cap, size_t size);
+static int lookup_cache(const char *key, const struct reqhdrs *h, char *vkey,
+			void **item, size_t *size);
+static void store_cache(const char *key, const struct reqhdrs *h, char *vkey,
+			const void *item, size_t size);
 int serve_static(int fd, const char *filename, int filesize);
 void get_filetype(const char *filename, char *filetype);
-int parse_uri(char *uri, char *host, char *service, char *path);
+int parse_requestline(char *line, char **method, char **uri, char **version);
 void *thread(void *vargp);
+static void conn_enter(void);
+static void conn_exit(void);
+static int take_listenfd(const char *path);
+static int give_listenfd(int ctlfd, int lisfd);
+static void drain(void);
+static void reject(int fd, char *client, char *errnum, char *shortmsg,
+		   char *longmsg);
 
 struct cache cache;
+struct pool riopool;   /* rio_t and rio_out_t buffers */
+struct pool linepool;  /* MAXLINE text buffers */
+struct pool hdrpool;   /* HDR_MAXSIZE request header blocks */
+struct pool relaypool; /* conf.relay_bufsize response rings */
+static int nconns; /* Connections being served */
+static pthread_mutex_t nconns_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nconns_cond = PTHREAD_COND_INITIALIZER;
+static volatile sig_atomic_t reload; /* SIGHUP asked to reread the peers */
+static int draining; /* The listener is handed over; keep nothing open */
+
+struct conf conf = {
+    .hdr_timeout = 10000,
+    .conn_timeout = 10000,
+    .conn_delay = 250,
+    .sockbuf = 0,
+    .idle_timeout = 30000,
+    .total_timeout = 300000,
+    .relay_bufsize = 65536,
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-r hdr_ms] [-c conn_ms] [-i idle_ms] [-t total_ms] "
+		"[-b relay_bytes] [-d delay_ms] [-s sockbuf_bytes] "
+		"[-q strip_params] [-o] [-U upgrade_sock] [-m cache_shm] "
+		"[-P peers_conf -n name] [-C client_conns] [-H host_conns] "
+		"[-R rate[:burst]] [-M max_conns [-Q max_queued]] <port>\n",
+		prog);
+	exit(1);
+}
+
+static long parse_num(const char *prog, const char *s, long min)
+{
+	char *end;
+	const long v = strtol(s, &end, 10);
+	if (*s == '\0' || *end != '\0' || v < min || v > INT_MAX) {
+		usage(prog);
+	}
+	return v;
+}
+
+static void sighup_handler(int sig)
+{
+	(void)sig;
+	reload = 1;
+}
 
 int main(int argc, char **argv)
 {
 	/* Check command line args */
-	if (argc != 2) {
-		fprintf(stderr, "usage: %s <port>\n", argv[0]);
-		exit(1);
+	int opt, sort_query = 0;
+	const char *strip_query = NULL, *upgrade_path = NULL,
+		   *cache_name = NULL, *peers_path = NULL, *self_name = "";
+	struct limits limits = {.max_queued = 1024};
+	static const char optstring[] = "r:c:i:t:b:d:s:q:oU:m:P:n:C:H:R:M:Q:";
+	while ((opt = getopt(argc, argv, optstring)) != -1) {
+		switch (opt) {
+		case 'r':
+			conf.hdr_timeout = parse_num(argv[0], optarg, -1);
+			break;
+		case 'c':
+			conf.conn_timeout = parse_num(argv[0], optarg, -1);
+			break;
+		case 'i':
+			conf.idle_timeout = parse_num(argv[0], optarg, -1);
+			break;
+		case 't':
+			conf.total_timeout = parse_num(argv[0], optarg, 0);
+			break;
+		case 'b':
+			conf.relay_bufsize = parse_num(argv[0], optarg, 1);
+			break;
+		case 'd':
+			conf.conn_delay = parse_num(argv[0], optarg, 0);
+			break;
+		case 's':
+			conf.sockbuf = parse_num(argv[0], optarg, 0);
+			break;
+		case 'q':
+			strip_query = optarg;
+			break;
+		case 'o':
+			sort_query = 1;
+			break;
+		case 'U':
+			upgrade_path = optarg;
+			break;
+		case 'm':
+			cache_name = optarg;
+			break;
+		case 'P':
+			peers_path = optarg;
+			break;
+		case 'n':
+			self_name = optarg;
+			break;
+		case 'C':
+			limits.client_conns = parse_num(argv[0], optarg, 0);
+			break;
+		case 'H':
+			limits.host_conns = parse_num(argv[0], optarg, 0);
+			break;
+		case 'R': {
+			char *colon = strchr(optarg, ':');
+			if (colon != NULL) {
+				*colon = '\0';
+				limits.burst = parse_num(argv[0], colon + 1, 1);
+			}
+			limits.rate = parse_num(argv[0], optarg, 0);
+			break;
+		}
+		case 'M':
+			limits.max_conns = parse_num(argv[0], optarg, 0);
+			break;
+		case 'Q':
+			limits.max_queued = parse_num(argv[0], optarg, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
 	}
 
 	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
 		unix_error("signal");
 	}
 
-	cache = Make_cache();
+	if (set_query_rules(strip_query, sort_query) < 0) {
+		exit(1);
+	}
+	if (limits.burst == 0) {
+		limits.burst = limits.rate; /* A second's worth */
+	}
+	limit_init(&limits);
+
+	/* SIGHUP rereads the peer config, which should have this proxy in it */
+	if (peers_path != NULL) {
+		if (peer_load(peers_path, self_name) < 0) {
+			exit(1);
+		}
+		if (signal(SIGHUP, sighup_handler) == SIG_ERR) {
+			unix_error("signal");
+		}
+	}
+
+	cache = Make_cache(cache_name);
+	pmu_init();
+	Init_pool(&riopool, RIO_OBJSIZE, POOL_MAXFREE);
+	Init_pool(&linepool, MAXLINE, POOL_MAXFREE);
+	Init_pool(&hdrpool, HDR_MAXSIZE, POOL_MAXFREE);
+	Init_pool(&relaypool, conf.relay_bufsize, RELAY_MAXFREE);
 
 	pthread_t tid;
-	const int lisfd = Open_listenfd(argv[1]);
+	pthread_attr_t attr;
+	int rc;
+	if ((rc = pthread_attr_init(&attr)) != 0 ||
+	    (rc = pthread_attr_setstacksize(&attr, THREAD_STACKSIZE)) != 0) {
+		posix_error(rc, "pthread_attr");
+	}
+
+	/* Take over the listener of a running proxy, if there is one */
+	int lisfd = -1, ctlfd = -1;
+	if (upgrade_path != NULL) {
+		lisfd = take_listenfd(upgrade_path);
+	}
+	if (lisfd < 0) {
+		lisfd = Open_listenfd(argv[optind]);
+	}
+	if (upgrade_path != NULL &&
+	    (ctlfd = open_unixlistenfd(upgrade_path)) < 0) {
+		unix_error("open_unixlistenfd");
+	}
 
 	while (1) {
+		struct pollfd pfds[2] = {{lisfd, POLLIN, 0},
+					 {ctlfd, POLLIN, 0}};
+		const int n = poll(pfds, ctlfd >= 0 ? 2 : 1, -1);
+		if (reload) {
+			reload = 0;
+			peer_load(peers_path, self_name);
+		}
+		if (n < 0) {
+			if (errno != EINTR) {
+				msg_unix_error("poll");
+			}
+			continue;
+		}
+
+		/* A new proxy is asking for the listener */
+		if (ctlfd >= 0 && pfds[1].revents &&
+		    give_listenfd(ctlfd, lisfd) == 0) {
+			close(lisfd);
+			close(ctlfd);
+			__atomic_store_n(&draining, 1, __ATOMIC_RELAXED);
+			drain();
+			cache_detach(&cache); /* Stragglers may be in it */
+			exit(0);
+		}
+		if (!pfds[0].revents) {
+			continue;
+		}
+
 		/* Create a connection */
 		socklen_t addrlen = sizeof(struct sockaddr_storage);
 		struct sockaddr_storage caddr;
-		int *confd = malloc(sizeof(int));
-		if (confd == NULL) {
+		struct conn *conn = malloc(sizeof *conn);
+		if (conn == NULL) {
 			/* malloc failed! Maybe crashing is a good idea... */
 			msg_unix_error("malloc");
 			continue;
 		}
-		*confd = accept(lisfd, (SA *)&caddr, &addrlen);
-		if (*confd < 0) {
+		conn->fd = accept(lisfd, (SA *)&caddr, &addrlen);
+		if (conn->fd < 0) {
 			/* Accept failed; continue on the next client attempt */
 			msg_unix_error("accept");
+			free(conn);
 			continue;
 		}
 
-		char host[NI_MAXHOST];
+		/* Numeric, as a reverse lookup would hold up accepting, and
+		 * the address is what clients are accounted by */
 		char service[NI_MAXSERV];
-		int rc = getnameinfo((SA *)&caddr, addrlen, host, NI_MAXHOST,
-				     service, NI_MAXSERV, 0);
+		rc = getnameinfo((SA *)&caddr, addrlen, conn->client,
+				 NI_MAXHOST, service, NI_MAXSERV,
+				 NI_NUMERICHOST | NI_NUMERICSERV);
 		char addr_str[ADDRSTRLEN];
 		if (rc == 0) {
-			snprintf(addr_str, ADDRSTRLEN, "(%s, %s)", host,
-				 service);
+			snprintf(addr_str, ADDRSTRLEN, "(%s, %s)",
+				 conn->client, service);
 		} else {
 			// Log on stderr but proceed
 			msg_gai_error(rc, "getnameinfo");
 			snprintf(addr_str, ADDRSTRLEN, "(UNKNOWN)");
+			strcpy(conn->client, "UNKNOWN");
 		}
 		printf("Accepted connection from %s\n", addr_str);
 
-		rc = pthread_create(&tid, NULL, thread, confd);
+		/* Serve it, have it wait its turn, or turn it away */
+		rc = limit_admit(conn->fd, conn->client,
+				 peer_known(conn->client));
+		if (rc == LIMIT_CLIENT) {
+			reject(conn->fd, conn->client, "429",
+			       "Too Many Requests",
+			       "Proxy has too many connections from");
+		} else if (rc == LIMIT_FULL) {
+			reject(conn->fd, conn->client, "503",
+			       "Service Unavailable",
+			       "Proxy is too busy to take a connection from");
+		} else if (rc == LIMIT_QUEUED) {
+			conn_enter();
+		}
+		if (rc != LIMIT_RUN) {
+			free(conn);
+			continue;
+		}
+
+		conn_enter();
+		rc = pthread_create(&tid, &attr, thread, conn);
 		if (rc) {
 			msg_posix_error(rc, "pthread_create");
-			if (close(*confd) < 0) {
-				msg_unix_error("close");
-			}
+			/* Close it, and any connections handed on to it */
+			do {
+				if (close(conn->fd) < 0) {
+					msg_unix_error("close");
+				}
+				conn_exit();
+			} while ((conn->fd = limit_done(conn->client)) >= 0);
+			free(conn);
 		}
 	}
 }
 
+/*
+ * reject - turn the connection fd away with a short error, in the accept
+ *     loop rather than on a thread of its own
+ */
+static void reject(int fd, char *client, char *errnum, char *shortmsg,
+		   char *longmsg)
+{
+	rio_out_t *wp = pool_get(&riopool);
+	if (wp != NULL) {
+		rio_writeinitb(wp, fd, REJECT_TIMEOUT, 0);
+		clienterror(wp, client, errnum, shortmsg, longmsg);
+		pool_put(&riopool, wp);
+	}
+
+	/* Take in what the client has sent so far, so that closing does
+	 * not reset the connection before it reads the reply */
+	char buf[512];
+	shutdown(fd, SHUT_WR);
+	while (recv(fd, buf, sizeof buf, MSG_DONTWAIT) > 0)
+		;
+	if (close(fd) < 0) {
+		msg_unix_error("close");
+	}
+}
+
+/*
+ * conn_enter, conn_exit - count the connections being served, so a proxy
+ *     that handed its listener over knows when it has drained
+ */
+static void conn_enter(void)
+{
+	pthread_mutex_lock(&nconns_mutex);
+	++nconns;
+	pthread_mutex_unlock(&nconns_mutex);
+}
+
+static void conn_exit(void)
+{
+	pthread_mutex_lock(&nconns_mutex);
+	if (--nconns == 0) {
+		pthread_cond_broadcast(&nconns_cond);
+	}
+	pthread_mutex_unlock(&nconns_mutex);
+}
+
+/*
+ * take_listenfd - ask the proxy serving upgrades on path for its listening
+ *     socket. Returns it, or -1 if there is no such proxy.
+ */
+static int take_listenfd(const char *path)
+{
+	const int ctlfd = open_unixclientfd(path);
+	if (ctlfd < 0) {
+		return -1; /* Nobody to take over from */
+	}
+
+	char tag;
+	const int lisfd = recv_fd(ctlfd, &tag);
+	if (lisfd < 0 || tag != UPGRADE_TAG) {
+		msg_unix_error("recv_fd");
+		if (lisfd >= 0) {
+			close(lisfd);
+		}
+		close(ctlfd);
+		return -1;
+	}
+
+	/* Acknowledge, so the old proxy stops accepting */
+	if (rio_writen(ctlfd, &tag, 1) != 1) {
+		msg_unix_error("rio_writen");
+	}
+	close(ctlfd);
+
+	printf("Took over the listener from %s\n", path);
+	return lisfd;
+}
+
+/*
+ * give_listenfd - hand lisfd to the new proxy connecting on ctlfd. Returns
+ *     0 once it has acknowledged, after which this proxy must stop
+ *     accepting; -1 if it went away and this proxy should carry on.
+ */
+static int give_listenfd(int ctlfd, int lisfd)
+{
+	const int fd = accept(ctlfd, NULL, NULL);
+	if (fd < 0) {
+		msg_unix_error("accept");
+		return -1;
+	}
+
+	char ack;
+	int rc = -1;
+	if (send_fd(fd, lisfd, UPGRADE_TAG) < 0) {
+		msg_unix_error("send_fd");
+	} else if (rio_wait(fd, POLLIN, UPGRADE_TIMEOUT, 0) < 0 ||
+		   rio_readn(fd, &ack, 1) != 1 || ack != UPGRADE_TAG) {
+		fprintf(stderr, "give_listenfd: no acknowledgement\n");
+	} else {
+		rc = 0;
+	}
+
+	close(fd);
+	return rc;
+}
+
+/*
+ * drain - wait for the connections in flight to finish, but for no longer
+ *     than a transaction may take
+ */
+static void drain(void)
+{
+	const long long deadline =
+	    conf.total_timeout > 0 ? rio_now() + conf.total_timeout : 0;
+
+	pthread_mutex_lock(&nconns_mutex);
+	printf("Handed over the listener; draining %d connections\n", nconns);
+	while (nconns > 0 && (!deadline || rio_now() < deadline)) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		++ts.tv_sec;
+		pthread_cond_timedwait(&nconns_cond, &nconns_mutex, &ts);
+	}
+	printf("Drained, %d connections left\n", nconns);
+	pthread_mutex_unlock(&nconns_mutex);
+	fflush(stdout);
+}
+
 /*
  * thread routine
  */
 void *thread(void *vargp)
 {
-	const int confd = *((int *)vargp);
+	struct conn *conn = vargp;
+	rio_t *conrio = NULL;
+
+	/* Leave SIGHUP to the main thread, to wake it from poll() */
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
 
 	const int rc = pthread_detach(pthread_self());
-	free(vargp);
 	if (rc) {
 		msg_posix_error(rc, "pthread_detach");
-		goto cleanup;
+	} else {
+		conrio = pool_get(&riopool);
 	}
 
-	forward(confd);
-
-cleanup:
-	if (close(confd) < 0) {
-		msg_unix_error("close");
-	}
+	/* Serve the connection, then each waiting one limit_done() hands on.
+	 * Sibling proxies keep their connections for more requests. */
+	do {
+		if (conrio != NULL) {
+			rio_readinitb(conrio, conn->fd);
+			for (int first = 1;
+			     forward(conn->fd, conn->client, conrio, first) > 0;
+			     first = 0)
+				;
+		}
+		if (close(conn->fd) < 0) {
+			msg_unix_error("close");
+		}
+		conn_exit();
+	} while ((conn->fd = limit_done(conn->client)) >= 0);
 
+	pool_put(&riopool, conrio);
+	free(conn);
 	return NULL;
 }
 
 /*
- * forward - forward one HTTP request/response transaction
+ * forward - forward one HTTP request/response transaction. Returns 1 if
+ *     the connection may carry another request, which is only the case
+ *     for a sibling proxy, whose responses are framed as HTTP chunks.
  */
-void forward(int confd)
+int forward(int confd, const char *client, rio_t *conrio, int first)
 {
+	/* The request head must arrive within hdr_timeout, and everything
+	 * within total_timeout */
+	const long long start = rio_now();
+	const long long deadline =
+	    conf.total_timeout > 0 ? start + conf.total_timeout : 0;
+	long long hdr_deadline = deadline;
+	if (conf.hdr_timeout >= 0 &&
+	    (!deadline || start + conf.hdr_timeout < deadline)) {
+		hdr_deadline = start + conf.hdr_timeout;
+	}
+
+	/* Connection state comes from the pools and goes back at cleanup, so
+	 * an idle connection holds just its read buffer and request line */
+	rio_out_t *conout = NULL, *cliout = NULL;
+	char *line = NULL, *key = NULL, *vkey = NULL;
+	struct reqhdrs hdrs = {NULL, 0, 0, 0};
+	struct fill fill = {NULL, 0, 0, 0};
+	void *item = NULL;
+	int clifd = -1, keep = 0, host_held = 0;
+
+	if ((line = pool_get(&linepool)) == NULL) {
+		goto cleanup;
+	}
+
 	/* Read request line and headers */
-	char buf[2 * MAXLINE + 15];
-	rio_t conrio;
-	rio_readinitb(&conrio, confd);
-	ssize_t rc = rio_readlineb(&conrio, buf, MAXLINE);
-	if (rc == 0) {
-		return;
-	} else if (rc < 0) {
-		msg_unix_error("rio_readlineb");
-		return;
+	rio_settimeout(conrio, conf.idle_timeout, hdr_deadline);
+	ssize_t rc = rio_readlineb(conrio, line, MAXLINE);
+	if (rc == 0 || (rc < 0 && !first)) {
+		goto cleanup; /* Closed, or an idle sibling connection */
+	}
+	if ((conout = pool_get(&riopool)) == NULL) {
+		goto cleanup;
+	}
+	rio_writeinitb(conout, confd, conf.idle_timeout, deadline);
+	if (rc < 0) {
+		if (errno == ETIMEDOUT) {
+			clienterror(conout, "request line", "408",
+				    "Request Timeout",
+				    "Proxy gave up waiting for the");
+		} else {
+			msg_unix_error("rio_readlineb");
+		}
+		goto cleanup;
 	}
-	printf("Request headers:\n%s", buf);
+	printf("Request headers:\n%s", line);
 
-	char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-	sscanf(buf, "%s %s %s", method, uri, version);
+	char *method, *uri, *version;
+	if (parse_requestline(line, &method, &uri, &version) < 0) {
+		clienterror(conout, "request line", "400", "Bad Request",
+			    "Proxy could not parse the");
+		goto cleanup;
+	}
 	if (strcasecmp(method, "CONNECT") == 0) {
 		// Establish connection
 		static const char conn_estab[] =
 		    "HTTP/1.0 200 Connection Established\r\n\r\n";
 		const size_t len = sizeof conn_estab - 1;
-		if (rio_writen(confd, conn_estab, len) != len) {
-			msg_unix_error("rio_writen");
+		if (rio_writerefb(conout, conn_estab, len) != len) {
+			msg_unix_error("rio_writerefb");
 		}
-		return;
+		goto cleanup;
+	} else if (strcasecmp(method, "PURGE") == 0 ||
+		   (strcasecmp(method, "GET") == 0 &&
+		    strncmp(uri, PURGE_PATH, sizeof PURGE_PATH - 1) == 0)) {
+		purge(confd, conrio, conout, method, uri);
+		goto cleanup;
+	} else if (strcasecmp(method, "GET") == 0 &&
+		   strncmp(uri, STATS_PATH, sizeof STATS_PATH - 1) == 0) {
+		stats(confd, conrio, conout, uri);
+		goto cleanup;
 	} else if (strcasecmp(method, "GET")) {
-		clienterror(confd, method, "501", "Not Implemented",
+		clienterror(conout, method, "501", "Not Implemented",
 			    "Proxy does not implement this method");
-		return;
+		goto cleanup;
+	}
+
+	struct uri u;
+	if (parse_uri(uri, &u) < 0 ||
+	    (key = pool_get(&linepool)) == NULL ||
+	    canon_uri(uri, key, MAXLINE) < 0) {
+		clienterror(conout, uri, "400", "Bad Request",
+			    "Proxy could not parse the URI");
+		goto cleanup;
+	}
+
+	printf("DEBUG: %s %s %.*s\n", u.host, u.service, (int)u.path_len,
+	       u.path);
+
+	/* The headers are needed to pick among cached variants */
+	if ((hdrs.buf = pool_get(&hdrpool)) == NULL) {
+		goto cleanup;
+	}
+	if (read_requesthdrs(conrio, &hdrs) < 0) {
+		if (errno == EMSGSIZE) {
+			clienterror(conout, "request", "431",
+				    "Request Header Fields Too Large",
+				    "Proxy cannot take the headers of this");
+		} else if (errno == ETIMEDOUT) {
+			clienterror(conout, "request headers", "408",
+				    "Request Timeout",
+				    "Proxy gave up waiting for the");
+		}
+		goto cleanup;
+	}
+
+	/* Anyone can send the peer header, so it only counts from a host
+	 * in the peer config; it is never forwarded either way */
+	if (hdrs.peer && !peer_known(client)) {
+		hdrs.peer = 0;
+	}
+
+	/* Everything a sibling gets back is chunked, so that it can tell
+	 * where the response ends and reuse the connection */
+	if (hdrs.peer) {
+		rio_setchunked(conout);
+	} else if (limit_request(client) < 0) {
+		clienterror(conout, (char *)client, "429", "Too Many Requests",
+			    "Proxy has too many requests from");
+		goto cleanup;
 	}
 
 	/* Check cache */
 	size_t item_size;
-	if (get_cache(&cache, uri, (void *)buf, &item_size) == 0) {
+	if ((vkey = pool_get(&linepool)) == NULL) {
+		goto cleanup;
+	}
+	if (lookup_cache(key, &hdrs, vkey, &item, &item_size) == 0) {
 		puts("DEBUG: $ hit!");
-		if (rio_writen(confd, buf, item_size) != item_size) {
-			msg_unix_error("rio_writen");
+		if (rio_writerefb(conout, item, item_size) != item_size) {
+			msg_unix_error("rio_writerefb");
+			goto cleanup;
 		}
-		return;
+		goto done;
 	}
 
-	char host[NI_MAXHOST];
-	char service[NI_MAXSERV];
-	char path[MAXLINE];
-	char uri_cpy[MAXLINE];
-	strcpy(uri_cpy, uri);
-	parse_uri(uri_cpy, host, service, path);
-
-	printf("DEBUG: %s %s %s\n", host, service, path);
+	/* A miss on a key another proxy owns is that proxy's to fetch and
+	 * cache, unless it cannot be reached */
+	struct peer owner;
+	const int remote = !hdrs.peer && peer_owner(key, &owner);
+	if (remote) {
+		rc = fetch_peer(&owner, uri, &hdrs, conout, deadline, vkey);
+		if (rc <= 0) {
+			goto cleanup;
+		}
+		fprintf(stderr, "forward: peer %s failed, going to %s\n",
+			owner.name, u.host);
+	}
 
 	/* Connect to the end server */
-	const int clifd = open_clientfd(host, service);
+	if (limit_host_enter(u.host) < 0) {
+		clienterror(conout, u.host, "503", "Service Unavailable",
+			    "Proxy has too many connections open to");
+		goto done;
+	}
+	host_held = 1;
+	int conn_timeout = conf.conn_timeout;
+	if (deadline) {
+		const long long left = deadline - rio_now();
+		if (conn_timeout < 0 || left < conn_timeout) {
+			conn_timeout = left > 0 ? left : 0;
+		}
+	}
+	clifd = open_clientfd(u.host, u.service, conn_timeout,
+			      conf.conn_delay, conf.sockbuf);
 	if (clifd < 0) {
-		return;
+		if (clifd == -1 && errno == ETIMEDOUT) {
+			clienterror(conout, u.host, "504", "Gateway Timeout",
+				    "Proxy timed out connecting to");
+		} else if (hdrs.peer) {
+			clienterror(conout, u.host, "502", "Bad Gateway",
+				    "Proxy could not connect to");
+		}
+		goto done;
 	}
 
-	rio_t clirio;
-	rio_readinitb(&clirio, clifd);
-
-	/* Forward METHOD URI VERSION */
-	sprintf(buf, "%s %s %s\r\n", method, /*uri*/path, "HTTP/1.0");
-	printf("!!!DEBUG: %s", buf);
-	const size_t buflen = strlen(buf);
-	if (rio_writen(clifd, buf, buflen) != buflen) {
-		msg_unix_error("rio_writen");
+	/* Forward METHOD URI VERSION, then the headers, as one write */
+	if ((cliout = pool_get(&riopool)) == NULL) {
+		goto cleanup;
+	}
+	rio_writeinitb(cliout, clifd, conf.idle_timeout, deadline);
+	rio_cork(cliout);
+	if (forward_requestline(cliout, method, &u) < 0 ||
+	    forward_requesthdrs(cliout, &hdrs, u.host) < 0) {
 		goto cleanup;
 	}
-	if (forward_requesthdrs(&conrio, clifd, host) < 0) {
+	if (rio_uncork(cliout) < 0) {
+		msg_unix_error("rio_uncork");
 		goto cleanup;
 	}
 
+	/* Only the relay's buffers (and the headers, for Vary) are needed
+	 * from here on */
+	pool_put(&riopool, cliout);
+	cliout = NULL;
+
 	/* Receive from the end server */
-	char tmp_item[MAX_OBJECT_SIZE];
-	char *cache_p = tmp_item;
-	int can_save = 1;
-	ssize_t n;
-	while ((n = rio_readnb(&clirio, buf, MAXLINE)) != 0) {
+	if (hdrs.peer) {
+		char *buf = pool_get(&linepool);
+		rc = buf ? relay_chunked(clifd, conout, deadline, &fill, buf)
+			 : -1;
+		pool_put(&linepool, buf);
+	} else {
+		rc = relay(clifd, confd, deadline, &fill);
+	}
+	if (rc < 0) {
+		goto cleanup;
+	}
+	if (!remote && fill.collect && fill.len > 0) {
+		store_cache(key, &hdrs, vkey, fill.item, fill.len);
+	}
+
+done:
+	/* A sibling's connection is closed once its reply is done if this
+	 * proxy is on its way out, or it would be kept busy to the end */
+	if (hdrs.peer) {
+		keep = rio_endchunks(conout) == 0 &&
+		       !__atomic_load_n(&draining, __ATOMIC_RELAXED);
+	}
+
+cleanup:
+	if (clifd >= 0 && close(clifd) < 0) {
+		msg_unix_error("close");
+	}
+	if (host_held) {
+		limit_host_exit(u.host);
+	}
+	free(item);
+	free(fill.item);
+	pool_put(&hdrpool, hdrs.buf);
+	pool_put(&linepool, vkey);
+	pool_put(&linepool, key);
+	pool_put(&riopool, cliout);
+	pool_put(&riopool, conout);
+	pool_put(&linepool, line);
+	return keep;
+}
+
+/*
+ * relay - copy the end server's response on srcfd to the client on dstfd
+ *     through a bounded buffer of conf.relay_bufsize bytes. The server is
+ *     only read while the buffer has room, so a client that stops draining
+ *     stalls the server instead of growing memory, and is dropped once
+ *     idle_timeout or deadline passes.
+ *
+ *     A cacheable response (200, at most MAX_OBJECT_SIZE bytes) is also
+ *     collected into f as data arrives.
+ */
+ssize_t relay(int srcfd, int dstfd, long long deadline, struct fill *f)
+{
+	char *ring = pool_get(&relaypool);
+	if (ring == NULL) {
+		return -1;
+	}
+
+	const size_t cap = conf.relay_bufsize;
+	size_t head = 0, len = 0;
+	int eof = 0;
+	ssize_t rc = -1;
+
+	while (!eof || len > 0) {
+		/* An end left out must be -1, as poll() reports POLLHUP and
+		 * POLLERR even for no events */
+		struct pollfd pfds[2] = {{-1, POLLIN, 0}, {-1, POLLOUT, 0}};
+		if (!eof && len < cap) {
+			pfds[0].fd = srcfd;
+		}
+		if (len > 0) {
+			pfds[1].fd = dstfd;
+		}
+
+		int timeout = conf.idle_timeout;
+		if (deadline) {
+			const long long left = deadline - rio_now();
+			if (left <= 0) {
+				fprintf(stderr,
+					"relay: transaction timed out\n");
+				goto out;
+			}
+			if (timeout < 0 || left < timeout) {
+				timeout = left;
+			}
+		}
+
+		const int n = poll(pfds, 2, timeout);
 		if (n < 0) {
-			msg_unix_error("rio_readlineb");
-			goto cleanup;
+			if (errno == EINTR) {
+				continue;
+			}
+			msg_unix_error("poll");
+			goto out;
+		} else if (n == 0) {
+			fprintf(stderr, "relay: connection stalled\n");
+			goto out;
 		}
-		if (rio_writen(confd, buf, n) != n) {
-			msg_unix_error("rio_writen");
-			goto cleanup;
+
+		if (pfds[0].revents) {
+			/* Fill the contiguous free region after the data */
+			const size_t tail = (head + len) % cap;
+			const size_t room =
+			    tail < head ? head - tail : cap - tail;
+			const ssize_t nread = read(srcfd, ring + tail, room);
+			if (nread < 0) {
+				if (errno != EINTR && errno != EAGAIN) {
+					msg_unix_error("read");
+					goto out;
+				}
+			} else if (nread == 0) {
+				eof = 1;
+			} else {
+				fill_add(f, ring + tail, nread);
+				len += nread;
+			}
+		}
+
+		if (pfds[1].revents) {
+			/* Drain the contiguous data region from head */
+			const size_t chunk =
+			    head + len > cap ? cap - head : len;
+			const ssize_t nsent =
+			    send(dstfd, ring + head, chunk, MSG_DONTWAIT);
+			if (nsent < 0) {
+				if (errno != EINTR && errno != EAGAIN &&
+				    errno != EWOULDBLOCK) {
+					msg_unix_error("send");
+					goto out;
+				}
+			} else {
+				head = (head + nsent) % cap;
+				len -= nsent;
+			}
 		}
+	}
 
-		if (n + (cache_p - tmp_item) > MAX_OBJECT_SIZE) {
-			can_save = 0;
+	rc = f->len;
+
+out:
+	pool_put(&relaypool, ring);
+	return rc;
+}
+
+/*
+ * relay_chunked - copy the end server's response on srcfd to the sibling
+ *     proxy behind wp, each read going out as one chunk, and collect it
+ *     into f like relay(). buf is MAXLINE bytes of scratch space.
+ */
+static ssize_t relay_chunked(int srcfd, rio_out_t *wp, long long deadline,
+			     struct fill *f, char *buf)
+{
+	while (1) {
+		if (rio_wait(srcfd, POLLIN, conf.idle_timeout, deadline) < 0) {
+			msg_unix_error("relay_chunked: rio_wait");
+			return -1;
+		}
+		const ssize_t nread = read(srcfd, buf, MAXLINE);
+		if (nread < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			msg_unix_error("read");
+			return -1;
+		} else if (nread == 0) {
+			break;
+		}
+		fill_add(f, buf, nread);
+		if (rio_writeb(wp, buf, nread) != nread) {
+			msg_unix_error("rio_writeb");
+			return -1;
+		}
+	}
+	return f->len;
+}
+
+/*
+ * peer_exchange - send the request for uri to a sibling proxy on fd and
+ *     copy the chunked response to the client behind wp. Returns 0 once
+ *     the last chunk is in, leaving fd ready for another request; 1 if it
+ *     failed before anything reached the client, -1 if after.
+ */
+static int peer_exchange(int fd, const char *uri, const struct reqhdrs *h,
+			 rio_out_t *wp, long long deadline, char *buf)
+{
+	rio_out_t *out = NULL;
+	rio_t *in = NULL;
+	int rc = 1;
+
+	if ((out = pool_get(&riopool)) == NULL ||
+	    (in = pool_get(&riopool)) == NULL) {
+		goto out;
+	}
+
+	/* The request as the client sent it, marked as coming from a peer */
+	static const char version[] = " HTTP/1.0\r\n" PEER_HDR ": ";
+	const char *self = peer_self();
+	rio_writeinitb(out, fd, conf.idle_timeout, deadline);
+	rio_cork(out);
+	if (rio_writeb(out, "GET ", 4) != 4 ||
+	    rio_writeb(out, uri, strlen(uri)) != strlen(uri) ||
+	    rio_writeb(out, version, sizeof version - 1) !=
+		sizeof version - 1 ||
+	    rio_writeb(out, self, strlen(self)) != strlen(self) ||
+	    rio_writeb(out, "\r\n", 2) != 2 ||
+	    (h->len > 0 && rio_writerefb(out, h->buf, h->len) != h->len) ||
+	    rio_writeb(out, "\r\n", 2) != 2 || rio_uncork(out) < 0) {
+		msg_unix_error("peer_exchange: write");
+		goto out;
+	}
+
+	/* Each chunk is "<hex size>\r\n<data>\r\n", the last one empty */
+	rio_readinitb(in, fd);
+	rio_settimeout(in, conf.idle_timeout, deadline);
+	while (1) {
+		if (rio_readlineb(in, buf, MAXLINE) <= 0) {
+			goto out;
+		}
+		char *end;
+		size_t size = strtoul(buf, &end, 16);
+		if (end == buf || (*end != '\r' && *end != '\n')) {
+			fprintf(stderr, "peer_exchange: bad chunk size\n");
+			goto out;
+		}
+		if (size == 0) {
+			if (rio_readlineb(in, buf, MAXLINE) <= 0) {
+				goto out;
+			}
+			rc = 0;
+			break;
+		}
+
+		while (size > 0) {
+			const size_t want = size < MAXLINE ? size : MAXLINE;
+			const ssize_t n = rio_readnb(in, buf, want);
+			if (n <= 0) {
+				goto out;
+			}
+			if (rio_writeb(wp, buf, n) != n) {
+				msg_unix_error("rio_writeb");
+				rc = -1;
+				goto out;
+			}
+			rc = -1; /* The client has part of the response now */
+			size -= n;
+		}
+		if (rio_readlineb(in, buf, MAXLINE) <= 0) {
+			goto out;
+		}
+	}
+
+out:
+	pool_put(&riopool, in);
+	pool_put(&riopool, out);
+	return rc;
+}
+
+/*
+ * fetch_peer - have the sibling proxy p serve uri to the client behind wp.
+ *     An idle connection found closed is retried once on a fresh one.
+ *     Returns 0 on success, 1 if the client got nothing and may still be
+ *     served from the end server, -1 otherwise. buf is MAXLINE bytes of
+ *     scratch space.
+ */
+static int fetch_peer(const struct peer *p, const char *uri,
+		      const struct reqhdrs *h, rio_out_t *wp,
+		      long long deadline, char *buf)
+{
+	int rc = 1;
+
+	for (int tries = 0; tries < 2 && rc > 0; ++tries) {
+		int conn_timeout = conf.conn_timeout, reused;
+		if (deadline) {
+			const long long left = deadline - rio_now();
+			if (left <= 0) {
+				return 1;
+			}
+			if (conn_timeout < 0 || left < conn_timeout) {
+				conn_timeout = left;
+			}
+		}
+
+		const int fd = peer_get(p, conn_timeout, &reused);
+		if (fd < 0) {
+			return 1;
+		}
+		rc = peer_exchange(fd, uri, h, wp, deadline, buf);
+		if (rc == 0) {
+			peer_put(p, fd);
 		} else {
-			memcpy(cache_p, buf, n);
-			cache_p += n;
+			close(fd);
 		}
+		if (!reused) {
+			break;
+		}
+	}
+	return rc;
+}
+
+/*
+ * fill_add - note the next n bytes of a response, collecting them into f
+ *     while it may still be cached
+ */
+static void fill_add(struct fill *f, const char *data, size_t n)
+{
+	if (f->len == 0) {
+		f->collect = cacheable(data, n);
 	}
-	if (can_save) {
-		put_cache(&cache, uri, tmp_item, cache_p - tmp_item);
+	if (f->collect && grow_item(&f->item, &f->cap, f->len + n) < 0) {
+		f->collect = 0;
 	}
+	if (f->collect) {
+		memcpy(f->item + f->len, data, n);
+	}
+	f->len += n;
+}
 
-cleanup:
-	if (close(clifd) < 0) {
-		msg_unix_error("close");
+/*
+ * cacheable - whether a response starting with the n bytes at resp may be
+ *     cached, judging by its status line
+ */
+static int cacheable(const char *resp, size_t n)
+{
+	static const char ok_status[] = " 200 ";
+
+	return n >= 13 && strncmp(resp, "HTTP/1.", 7) == 0 &&
+	       strncmp(resp + 8, ok_status, sizeof ok_status - 1) == 0;
+}
+
+/*
+ * grow_item - make the cache-fill buffer *item hold at least size bytes,
+ *     doubling from ITEM_MINSIZE. Fails once size exceeds MAX_OBJECT_SIZE.
+ */
+static int grow_item(char **item, size_t *cap, size_t size)
+{
+	if (size > MAX_OBJECT_SIZE) {
+		return -1;
+	}
+	if (size <= *cap) {
+		return 0;
+	}
+
+	size_t new_cap = *cap ? *cap : ITEM_MINSIZE;
+	while (new_cap < size) {
+		new_cap *= 2;
+	}
+	if (new_cap > MAX_OBJECT_SIZE) {
+		new_cap = MAX_OBJECT_SIZE;
 	}
+
+	char *new_item = realloc(*item, new_cap);
+	if (new_item == NULL) {
+		msg_unix_error("realloc");
+		return -1;
+	}
+	*item = new_item;
+	*cap = new_cap;
+	return 0;
+}
+
+/*
+ * purge - drop content from the cache. "PURGE <url>" drops url, with its
+ *     Vary variants, or, if url ends in '*', every URL starting with the
+ *     rest. "GET /purge?url=<url>" does the same as "PURGE <url>";
+ *     "?prefix=<url>" drops the URLs starting with url, and "?host=<host>"
+ *     every URL on host, over http or https and on any port. Only loopback
+ *     clients may purge.
+ */
+static int purge(int confd, rio_t *rp, rio_out_t *wp, const char *method,
+		 const char *uri)
+{
+	char *buf = NULL, *key = NULL;
+	int rc = -1;
+
+	if ((buf = pool_get(&linepool)) == NULL ||
+	    (key = pool_get(&linepool)) == NULL ||
+	    admin_request(confd, rp, wp, uri, buf) < 0) {
+		goto out;
+	}
+
+	/* Work out which keys are meant, as one or more prefixes */
+	const char *target = uri;
+	int exact = 1, host = 0;
+	if (strcasecmp(method, "GET") == 0) {
+		if (query_param(uri, "url", buf, MAXLINE) == 0) {
+			target = buf;
+		} else if (query_param(uri, "prefix", buf, MAXLINE) == 0) {
+			target = buf;
+			exact = 0;
+		} else if (query_param(uri, "host", buf, MAXLINE) == 0 &&
+			   buf[0] != '\0' && !strpbrk(buf, "/?#@")) {
+			host = 1;
+		} else {
+			clienterror(wp, (char *)uri, "400", "Bad Request",
+				    "Proxy takes url, prefix or host in");
+			goto out;
+		}
+	}
+
+	int purged = 0;
+	if (host) {
+		static const char *schemes[] = {"http://", "https://"};
+		for (int i = 0; i < 2; ++i) {
+			for (const char *sep = "/:"; *sep; ++sep) {
+				snprintf(key, MAXLINE, "%s%s%c", schemes[i],
+					 buf, *sep);
+				for (char *p = key; *p; ++p) {
+					*p = tolower((unsigned char)*p);
+				}
+				purged += purge_cache(&cache, key, 0);
+			}
+		}
+	} else {
+		/* A trailing '*' asks for a prefix purge, but canon_uri()
+		 * must not see it */
+		const size_t len = strlen(target);
+		if (exact && len > 0 && target[len - 1] == '*') {
+			if (target != buf) {
+				snprintf(buf, MAXLINE, "%s", target);
+				target = buf;
+			}
+			buf[len - 1] = '\0';
+			exact = 0;
+		}
+		if (canon_uri(target, key, MAXLINE) < 0) {
+			clienterror(wp, (char *)target, "400", "Bad Request",
+				    "Proxy could not parse the URI");
+			goto out;
+		}
+		purged = purge_cache(&cache, key, exact);
+	}
+	printf("Purged %d items for %s\n", purged, uri);
+
+	/* 404 when there was nothing to purge, as other caches do */
+	const int len = snprintf(buf, MAXLINE,
+				 "HTTP/1.0 %s\r\n"
+				 "Content-Type: text/plain\r\n\r\n"
+				 "Purged %d items\n",
+				 purged > 0 ? "200 OK" : "404 Not Found",
+				 purged);
+	if (rio_writeb(wp, buf, len) != len) {
+		msg_unix_error("rio_writeb");
+		goto out;
+	}
+	rc = 0;
+
+out:
+	pool_put(&linepool, key);
+	pool_put(&linepool, buf);
+	return rc;
+}
+
+/*
+ * stats - report the cache's footprint, how it sits in memory and what
+ *     that costs in TLB misses and remote NUMA loads, for "GET /stats", as
+ *     "name value" lines of plain text. Counts the hardware will not give
+ *     are "n/a".
+ */
+static int stats(int confd, rio_t *rp, rio_out_t *wp, const char *uri)
+{
+	static const char *backings[] = {"4k", "thp", "hugetlb"};
+	char *buf;
+	int rc = -1;
+
+	if ((buf = pool_get(&linepool)) == NULL ||
+	    admin_request(confd, rp, wp, uri, buf) < 0) {
+		goto out;
+	}
+
+	struct cache_stats st;
+	struct pmu_counts pc;
+	cache_stats(&cache, &st);
+	pmu_read(&pc);
+
+	int len = snprintf(buf, MAXLINE,
+			   "HTTP/1.0 200 OK\r\n"
+			   "Content-Type: text/plain\r\n\r\n"
+			   "cache_items %d\n"
+			   "cache_used_bytes %zu\n"
+			   "cache_mapped_bytes %zu\n"
+			   "cache_huge_bytes %zu\n"
+			   "cache_backing %s\n"
+			   "cache_hits %lu\n"
+			   "cache_misses %lu\n",
+			   st.items, st.used, st.mapped, st.huge,
+			   backings[st.backing], st.hits, st.misses);
+	for (int i = 0; i < CACHE_MAXNODES; ++i) {
+		if (st.node_pages[i] > 0) {
+			len += snprintf(buf + len, MAXLINE - len,
+					"cache_node%d_pages %zu\n", i,
+					st.node_pages[i]);
+		}
+	}
+	const struct {
+		const char *name;
+		long long n;
+	} counts[] = {{"dtlb_load_misses", pc.dtlb_misses},
+		      {"remote_node_loads", pc.remote_loads}};
+	for (int i = 0; i < 2; ++i) {
+		if (counts[i].n < 0) {
+			len += snprintf(buf + len, MAXLINE - len, "%s n/a\n",
+					counts[i].name);
+		} else {
+			len += snprintf(buf + len, MAXLINE - len, "%s %lld\n",
+					counts[i].name, counts[i].n);
+		}
+	}
+	if (rio_writeb(wp, buf, len) != len) {
+		msg_unix_error("rio_writeb");
+		goto out;
+	}
+	rc = 0;
+
+out:
+	pool_put(&linepool, buf);
+	return rc;
+}
+
+/*
+ * admin_request - read the rest of a request for an admin URL, whose
+ *     headers are of no use, into buf (MAXLINE bytes), and turn it away
+ *     unless it came from this host. Returns -1 if it is not to be served.
+ */
+static int admin_request(int confd, rio_t *rp, rio_out_t *wp,
+			 const char *uri, char *buf)
+{
+	ssize_t n;
+	while ((n = rio_readlineb(rp, buf, MAXLINE)) > 0 &&
+	       strcmp(buf, "\r\n") != 0 && strcmp(buf, "\n") != 0)
+		;
+	if (n < 0) {
+		msg_unix_error("rio_readlineb");
+		return -1;
+	}
+
+	if (!is_loopback(confd)) {
+		clienterror(wp, (char *)uri, "403", "Forbidden",
+			    "Proxy only takes admin requests from this host, "
+			    "not");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * is_loopback - whether the peer on the socket fd is on this host
+ */
+static int is_loopback(int fd)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof addr;
+	if (getpeername(fd, (SA *)&addr, &addrlen) < 0) {
+		msg_unix_error("getpeername");
+		return 0;
+	}
+
+	if (addr.ss_family == AF_INET) {
+		const struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+		return (ntohl(sin->sin_addr.s_addr) >> 24) == 127;
+	} else if (addr.ss_family == AF_INET6) {
+		const struct in6_addr *a =
+		    &((struct sockaddr_in6 *)&addr)->sin6_addr;
+		return IN6_IS_ADDR_LOOPBACK(a) ||
+		       (IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+	}
+	return 0;
 }
 
 /*
  * clienterror - returns an error message to the client
  */
-int clienterror(int fd, char *cause, char *errnum, char *shortmsg,
+int clienterror(rio_out_t *wp, char *cause, char *errnum, char *shortmsg,
 		char *longmsg)
 {
-	char buf[MAXLINE];
+	rio_cork(wp);
 
 	/* Print the HTTP response headers */
-	sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-	RIO_WRITEN(fd, buf, strlen(buf));
-	sprintf(buf, "Content-type: text/html\r\n\r\n");
-	RIO_WRITEN(fd, buf, strlen(buf));
+	RIO_PUTS(wp, "HTTP/1.0 ");
+	RIO_PUTS(wp, errnum);
+	RIO_PUTS(wp, " ");
+	RIO_PUTS(wp, shortmsg);
+	RIO_PUTS(wp, "\r\nContent-type: text/html\r\n\r\n");
 
 	/* Print the HTTP response body */
-	sprintf(buf, "<html><title>Proxy Error</title>");
-	RIO_WRITEN(fd, buf, strlen(buf));
-	sprintf(buf, "<body bgcolor=ffffff>\r\n");
-	RIO_WRITEN(fd, buf, strlen(buf));
-	sprintf(buf, "%s: %s\r\n", errnum, shortmsg);
-	RIO_WRITEN(fd, buf, strlen(buf));
-	sprintf(buf, "<p>%s: %s\r\n", longmsg, cause);
-	RIO_WRITEN(fd, buf, strlen(buf));
-	sprintf(buf, "<hr><em>The Proxy Web server</em>\r\n");
-	RIO_WRITEN(fd, buf, strlen(buf));
+	RIO_PUTS(wp, "<html><title>Proxy Error</title>");
+	RIO_PUTS(wp, "<body bgcolor=ffffff>\r\n");
+	RIO_PUTS(wp, errnum);
+	RIO_PUTS(wp, ": ");
+	RIO_PUTS(wp, shortmsg);
+	RIO_PUTS(wp, "\r\n<p>");
+	RIO_PUTS(wp, longmsg);
+	RIO_PUTS(wp, ": ");
+	RIO_PUTS(wp, cause);
+	RIO_PUTS(wp, "\r\n<hr><em>The Proxy Web server</em>\r\n");
 
+	if (rio_uncork(wp) < 0) {
+		msg_unix_error("rio_uncork");
+		return -1;
+	}
 	return 0;
 }
 
+/*
+ * forward_requestline - write the request line for the end server
+ */
+int forward_requestline(rio_out_t *wp, const char *method,
+			const struct uri *u)
+{
+	RIO_PUTS(wp, method);
+	RIO_PUTS(wp, " ");
+	if (u->path_len == 0 || u->path[0] != '/') {
+		RIO_PUTS(wp, "/");
+	}
+	RIO_WRITEB(wp, u->path, u->path_len);
+	RIO_PUTS(wp, " HTTP/1.0\r\n");
+	printf("!!!DEBUG: %s %.*s HTTP/1.0\r\n", method, (int)u->path_len,
+	       u->path);
+
+	return 0;
+}
+
+static const char host_hdr[] = "Host: ";
+static const char user_hdr[] =
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) "
+    "Gecko/20120305 Firefox/10.0.3\r\n";
+static const char conn_hdr[] = "Connection: close\r\n";
+static const char prox_hdr[] = "Proxy-Connection: close\r\n";
+
 #define HOST_HDR_LEN 5
 #define USER_HDR_LEN 11
 #define CONN_HDR_LEN 11
 #define PROX_HDR_LEN 17
 
 /*
- * forward_requesthdrs - read HTTP request headers
+ * read_requesthdrs - read HTTP request headers into h, dropping the ones
+ *     forward_requesthdrs() sends itself and noting the one marking a
+ *     sibling proxy's request. Returns -1 with errno set on error,
+ *     to EMSGSIZE if they do not fit in HDR_MAXSIZE bytes.
  */
-int forward_requesthdrs(rio_t *rp, int clifd, const char *host)
+int read_requesthdrs(rio_t *rp, struct reqhdrs *h)
 {
-	static const char host_hdr[] = "Host: ";
-	static const char user_hdr[] =
-	    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) "
-	    "Gecko/20120305 Firefox/10.0.3\r\n";
-	static const char conn_hdr[] = "Connection: close\r\n";
-	static const char prox_hdr[] = "Proxy-Connection: close\r\n";
-
-	/* Flags to keep track of if the original request headers contained the
-	 * header */
-	int host_fnd = 0;
-
-	char buf[MAXLINE];
-
 	while (1) {
-		if (rio_readlineb(rp, buf, MAXLINE) < 0) {
+		char *buf = h->buf + h->len;
+		const ssize_t rc = rio_readlineb(rp, buf, HDR_MAXSIZE - h->len);
+		if (rc < 0) {
 			msg_unix_error("rio_readlineb");
 			return -1;
+		} else if (rc == 0 || buf[rc - 1] != '\n') {
+			/* Client went away before finishing its headers, or
+			 * sent more than fits */
+			errno = h->len + rc == HDR_MAXSIZE - 1 ? EMSGSIZE : 0;
+			return -1;
 		}
 
-		if (strcmp(buf, "\r\n") == 0) {
+		if (strcmp(buf, "\r\n") == 0 || strcmp(buf, "\n") == 0) {
 			break;
 		}
 
-		if (strncmp(user_hdr, buf, USER_HDR_LEN) == 0 ||
-		    strncmp(conn_hdr, buf, CONN_HDR_LEN) == 0 ||
-		    strncmp(prox_hdr, buf, PROX_HDR_LEN) == 0) {
+		if (strncasecmp(user_hdr, buf, USER_HDR_LEN) == 0 ||
+		    strncasecmp(conn_hdr, buf, CONN_HDR_LEN) == 0 ||
+		    strncasecmp(prox_hdr, buf, PROX_HDR_LEN) == 0) {
 			/* Skip these, as we are going to manually send these */
 			continue;
 		}
 
-		if (strncmp(host_hdr, buf, HOST_HDR_LEN) == 0) {
+		if (strncasecmp(buf, PEER_HDR ":", sizeof PEER_HDR) == 0) {
+			/* Not forwarded: the end server is not a peer */
+			h->peer = 1;
+			continue;
+		}
+
+		if (strncasecmp(host_hdr, buf, HOST_HDR_LEN) == 0) {
 			/* Do not modify the host header */
-			host_fnd = 1;
+			h->host_fnd = 1;
 		}
-		RIO_WRITEN(clifd, buf, strlen(buf));
+		h->len += rc;
 		printf("DEBUG: %s", buf);
 	}
 
-	if (!host_fnd) {
-		strcpy(buf, user_hdr);
-		strcat(buf, host);
-		strcat(buf, "\r\n");
-		RIO_WRITEN(clifd, buf, strlen(buf));
-		printf("DEBUG: %s", buf);
+	return 0;
+}
+
+/*
+ * forward_requesthdrs - write the headers from read_requesthdrs() for the
+ *     end server, adding our own
+ */
+int forward_requesthdrs(rio_out_t *wp, const struct reqhdrs *h,
+			const char *host)
+{
+	if (h->len > 0 && rio_writerefb(wp, h->buf, h->len) != h->len) {
+		msg_unix_error("rio_writerefb");
+		return -1;
+	}
+
+	if (!h->host_fnd) {
+		RIO_WRITEB(wp, host_hdr, sizeof host_hdr - 1);
+		RIO_WRITEB(wp, host, strlen(host));
+		RIO_WRITEB(wp, "\r\n", 2);
+		printf("DEBUG: %s%s\r\n", host_hdr, host);
 	}
 
-	RIO_WRITEN(clifd, user_hdr, sizeof user_hdr - 1);
+	RIO_WRITEB(wp, user_hdr, sizeof user_hdr - 1);
 	printf("DEBUG: %s", user_hdr);
-	RIO_WRITEN(clifd, conn_hdr, sizeof conn_hdr - 1);
+	RIO_WRITEB(wp, conn_hdr, sizeof conn_hdr - 1);
 	printf("DEBUG: %s", conn_hdr);
-	RIO_WRITEN(clifd, prox_hdr, sizeof prox_hdr - 1);
+	RIO_WRITEB(wp, prox_hdr, sizeof prox_hdr - 1);
 	printf("DEBUG: %s", prox_hdr);
-	RIO_WRITEN(clifd, "\r\n", 2);
+	RIO_WRITEB(wp, "\r\n", 2);
 	printf("DEBUG: \r\n");
 
 	return 0;
 }
 
-int parse_uri(char *uri, char *host, char *service, char *path)
+/*
+ * find_hdrn - find the value of the header named by the name_len bytes at
+ *     name among the header lines of len bytes at hdrs, stopping at a blank
+ *     line. Returns a pointer to the value with its length in *vlen, trimmed
+ *     of surrounding blanks, or NULL.
+ */
+static const char *find_hdrn(const char *hdrs, size_t len, const char *name,
+			     size_t name_len, size_t *vlen)
 {
-	printf("DEBUG: parse_uri: %s\n", uri);
-	char *host_p;
-	if ((host_p = strstr(uri, "://")) == NULL) {
-		/* Does not start with http(s):// */
-		host_p = uri;
-	} else {
-		/* Does start with http(s):// */
-		host_p += 3;
+	const char *end = hdrs + len;
+
+	for (const char *p = hdrs; p < end;) {
+		const char *eol = memchr(p, '\n', end - p);
+		if (eol == NULL) {
+			eol = end;
+		}
+		if (p == eol || (*p == '\r' && p + 1 == eol)) {
+			break; /* End of headers */
+		}
+
+		if (eol - p > name_len && p[name_len] == ':' &&
+		    strncasecmp(p, name, name_len) == 0) {
+			const char *v = p + name_len + 1, *v_end = eol;
+			while (v < v_end && (*v == ' ' || *v == '\t'))
+				++v;
+			while (v_end > v && isspace((unsigned char)v_end[-1]))
+				--v_end;
+			*vlen = v_end - v;
+			return v;
+		}
+		p = eol + 1;
 	}
-	if (*host_p == '\0') {
+	return NULL;
+}
+
+/*
+ * find_hdr - find_hdrn() for the string name
+ */
+static const char *find_hdr(const char *hdrs, size_t len, const char *name,
+			    size_t *vlen)
+{
+	return find_hdrn(hdrs, len, name, strlen(name), vlen);
+}
+
+#define VARY_SUFFIX "\nvary" /* Cache key suffix for a URI's Vary list */
+
+/*
+ * vary_key - write the secondary cache key of a variant of key to vkey: key
+ *     followed by the lower-cased name and the request's value of each
+ *     header in the Vary list names. Returns -1 if it needs more than cap
+ *     bytes or names is "*".
+ */
+static int vary_key(char *vkey, size_t cap, const char *key,
+		    const char *names, size_t names_len,
+		    const struct reqhdrs *h)
+{
+	size_t len = strlen(key);
+	if (len >= cap) {
 		return -1;
 	}
+	memcpy(vkey, key, len);
 
-	char *port_p;
-	if ((port_p = strstr(host_p, ":")) == NULL) {
-		/* Implicit 80 port */
-		strcpy(service, "80");
-	} else {
-		*port_p++ = '\0'; /* '\0' terminate host_p & ++ to skip ':' */
-		for (; *port_p >= '0' && *port_p <= '9'; ++port_p) {
-			*service++ = *port_p;
+	for (const char *p = names, *end = names + names_len; p < end;) {
+		const char *comma = memchr(p, ',', end - p);
+		const char *name_end = comma ? comma : end;
+		while (p < name_end && isspace((unsigned char)*p))
+			++p;
+		size_t name_len = name_end - p;
+		while (name_len > 0 && isspace((unsigned char)p[name_len - 1]))
+			--name_len;
+
+		if (name_len > 0) {
+			if (name_len == 1 && *p == '*') {
+				return -1;
+			}
+
+			size_t vlen = 0;
+			const char *v =
+			    find_hdrn(h->buf, h->len, p, name_len, &vlen);
+			if (len + name_len + vlen + 3 >= cap) {
+				return -1;
+			}
+			vkey[len++] = '\n';
+			for (size_t i = 0; i < name_len; ++i) {
+				vkey[len++] = tolower((unsigned char)p[i]);
+			}
+			vkey[len++] = ':';
+			vkey[len++] = ' ';
+			if (v != NULL) {
+				memcpy(vkey + len, v, vlen);
+				len += vlen;
+			}
 		}
-		*service = '\0';
+		p = name_end + 1;
 	}
 
-	char *path_p;
-	if ((path_p = strstr(host_p, "/")) != NULL) {
-		strcpy(path, path_p);
-		/* '\0' terminate host_p, in case port was implicit */
-		*path_p = '\0';
-	} else if (port_p != NULL) {
-		strcpy(path, port_p);
-	} else {
-		strcpy(path, "/");
+	vkey[len] = '\0';
+	return 0;
+}
+
+/*
+ * lookup_cache - look up the response for key, or, if the cache recorded
+ *     that it varies on request headers, for the variant matching h. vkey
+ *     is MAXLINE bytes of scratch space.
+ */
+static int lookup_cache(const char *key, const struct reqhdrs *h, char *vkey,
+			void **item, size_t *size)
+{
+	int rc = -1;
+
+	if (get_cache(&cache, key, item, size) == 0) {
+		rc = 0;
+		goto out;
 	}
 
-	strcpy(host, host_p);
+	/* A Vary record lists the headers its variants are keyed on */
+	void *names;
+	size_t names_len;
+	const size_t key_len = strlen(key);
+	if (key_len + sizeof VARY_SUFFIX > MAXLINE) {
+		goto out;
+	}
+	memcpy(vkey, key, key_len);
+	memcpy(vkey + key_len, VARY_SUFFIX, sizeof VARY_SUFFIX);
+	if (get_cache(&cache, vkey, &names, &names_len) < 0) {
+		goto out;
+	}
+
+	rc = vary_key(vkey, MAXLINE, key, names, names_len, h);
+	free(names);
+	if (rc == 0) {
+		rc = get_cache(&cache, vkey, item, size);
+	}
+
+out:
+	cache_count(&cache, rc == 0);
+	return rc;
+}
+
+/*
+ * store_cache - cache the response item for key, as the variant matching h
+ *     if the response has a Vary header. vkey is MAXLINE bytes of scratch
+ *     space.
+ */
+static void store_cache(const char *key, const struct reqhdrs *h, char *vkey,
+			const void *item, size_t size)
+{
+	/* Skip the status line to the response headers */
+	const char *hdrs = memchr(item, '\n', size);
+	if (hdrs == NULL) {
+		return;
+	}
+	++hdrs;
+
+	size_t names_len;
+	const char *names = find_hdr(hdrs, (const char *)item + size - hdrs,
+				     "Vary", &names_len);
+	if (names == NULL) {
+		put_cache(&cache, key, item, size);
+		return;
+	}
+
+	if (vary_key(vkey, MAXLINE, key, names, names_len, h) < 0) {
+		return; /* Vary: *, or too long to key on */
+	}
+	put_cache(&cache, vkey, item, size);
+
+	const size_t key_len = strlen(key);
+	if (key_len + sizeof VARY_SUFFIX > MAXLINE) {
+		return;
+	}
+	memcpy(vkey, key, key_len);
+	memcpy(vkey + key_len, VARY_SUFFIX, sizeof VARY_SUFFIX);
+	put_cache(&cache, vkey, names, names_len);
+}
 
+/*
+ * parse_requestline - split line in place into its method, URI and version
+ */
+int parse_requestline(char *line, char **method, char **uri, char **version)
+{
+	static const char delim[] = " \t\r\n";
+	char *save;
+
+	if ((*method = strtok_r(line, delim, &save)) == NULL ||
+	    (*uri = strtok_r(NULL, delim, &save)) == NULL ||
+	    (*version = strtok_r(NULL, delim, &save)) == NULL) {
+		return -1;
+	}
 	return 0;
 }
@@ -2,8 +2,12 @@
  * The Rio package - Robust I/O functions
  ****************************************/
 
+#include <poll.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/errno.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "rio.h"
@@ -71,6 +75,11 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 	int cnt;
 
 	while (rp->rio_cnt <= 0) { /* Refill if buf is empty */
+		if ((rp->rio_timeout >= 0 || rp->rio_deadline) &&
+		    rio_wait(rp->rio_fd, POLLIN, rp->rio_timeout,
+			     rp->rio_deadline) < 0) {
+			return -1; /* errno set by rio_wait() */
+		}
 		rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof rp->rio_buf);
 		if (rp->rio_cnt < 0) {
 			if (errno != EINTR) {
@@ -102,6 +111,8 @@ void rio_readinitb(rio_t *rp, int fd)
 {
 	rp->rio_fd = fd;
 	rp->rio_cnt = 0;
+	rp->rio_timeout = -1;
+	rp->rio_deadline = 0;
 	rp->rio_bufptr = rp->rio_buf;
 }
 
@@ -127,30 +138,302 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 }
 
 /*
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readlineb - Robustly read a text line (buffered), copying up to the
+ *     newline straight out of the buffer rather than a byte at a time
  */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 {
-	int n, rc;
-	char c, *bufp = usrbuf;
+	char *bufp = usrbuf;
+	size_t n = 0;
 
-	for (n = 1; n < maxlen; n++) {
-		if ((rc = rio_read(rp, &c, 1)) == 1) {
-			*bufp++ = c;
-			if (c == '\n') {
-				n++;
+	while (n + 1 < maxlen) {
+		if (rp->rio_cnt <= 0) {
+			/* Refill the buffer, taking its first byte */
+			const ssize_t rc = rio_read(rp, bufp + n, 1);
+			if (rc < 0) {
+				return -1; /* Error */
+			} else if (rc == 0) {
+				break; /* EOF */
+			}
+			if (bufp[n++] == '\n') {
 				break;
 			}
-		} else if (rc == 0) {
-			if (n == 1) {
-				return 0; /* EOF, no data read */
-			} else {
-				break; /* EOF, some data was read */
+			continue;
+		}
+
+		size_t cnt = rp->rio_cnt;
+		if (cnt > maxlen - 1 - n) {
+			cnt = maxlen - 1 - n;
+		}
+		const char *nl = memchr(rp->rio_bufptr, '\n', cnt);
+		if (nl != NULL) {
+			cnt = nl - rp->rio_bufptr + 1;
+		}
+		memcpy(bufp + n, rp->rio_bufptr, cnt);
+		rp->rio_bufptr += cnt;
+		rp->rio_cnt -= cnt;
+		n += cnt;
+		if (nl != NULL) {
+			break;
+		}
+	}
+	if (maxlen > 0) {
+		bufp[n] = 0;
+	}
+	return n;
+}
+
+/*
+ * rio_now - Milliseconds on a monotonic clock, the time base for deadlines
+ */
+long long rio_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * rio_wait - Wait until fd is ready for events, for at most timeout ms
+ *    (-1 for no limit) and never past deadline (0 for none). Returns 0
+ *    when ready, -1 with errno set to ETIMEDOUT on timeout or set by
+ *    poll() on error.
+ */
+int rio_wait(int fd, short events, int timeout, long long deadline)
+{
+	struct pollfd pfd = {fd, events, 0};
+	int rc, wait;
+
+	do {
+		wait = timeout;
+		if (deadline) {
+			const long long left = deadline - rio_now();
+			if (left <= 0) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+			if (wait < 0 || left < wait) {
+				wait = left;
+			}
+		}
+	} while ((rc = poll(&pfd, 1, wait)) < 0 && errno == EINTR);
+
+	if (rc == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	return rc < 0 ? -1 : 0;
+}
+
+/*
+ * rio_settimeout - Bound every refill of rp by timeout ms (-1 for no limit)
+ *    and by the absolute deadline (0 for none)
+ */
+void rio_settimeout(rio_t *rp, int timeout, long long deadline)
+{
+	rp->rio_timeout = timeout;
+	rp->rio_deadline = deadline;
+}
+
+/*
+ * rio_writeinitb - Associate a descriptor with a write buffer whose flushes
+ *    give up once the peer has not drained anything for timeout ms or
+ *    deadline passes
+ */
+void rio_writeinitb(rio_out_t *wp, int fd, int timeout, long long deadline)
+{
+	wp->rio_fd = fd;
+	wp->rio_timeout = timeout;
+	wp->rio_deadline = deadline;
+	wp->rio_corked = 0;
+	wp->rio_chunked = 0;
+	wp->rio_iovcnt = 0;
+	wp->rio_len = 0;
+}
+
+/*
+ * rio_flushb - Robustly write out everything pending in wp, gathering it
+ *    into as few writev() calls as the descriptor allows. In chunked mode
+ *    it goes out as one HTTP chunk.
+ */
+int rio_flushb(rio_out_t *wp)
+{
+	struct iovec vec[RIO_IOVMAX + 2];
+	struct iovec *iov = vec;
+	int iovcnt = 0;
+	struct msghdr msg;
+	ssize_t nwritten;
+
+	if (wp->rio_iovcnt == 0) {
+		return 0;
+	}
+
+	if (wp->rio_chunked) {
+		size_t total = 0;
+		for (int i = 0; i < wp->rio_iovcnt; ++i) {
+			total += wp->rio_iov[i].iov_len;
+		}
+		vec[iovcnt].iov_base = wp->rio_chunkhdr;
+		vec[iovcnt++].iov_len =
+		    snprintf(wp->rio_chunkhdr, sizeof wp->rio_chunkhdr,
+			     "%zx\r\n", total);
+	}
+	memcpy(vec + iovcnt, wp->rio_iov, wp->rio_iovcnt * sizeof *vec);
+	iovcnt += wp->rio_iovcnt;
+	if (wp->rio_chunked) {
+		vec[iovcnt].iov_base = "\r\n";
+		vec[iovcnt++].iov_len = 2;
+	}
+
+	while (iovcnt > 0) {
+		if (rio_wait(wp->rio_fd, POLLOUT, wp->rio_timeout,
+			     wp->rio_deadline) < 0) {
+			return -1; /* errno set by rio_wait() */
+		}
+
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		if ((nwritten = sendmsg(wp->rio_fd, &msg, MSG_DONTWAIT)) < 0) {
+			if (errno == ENOTSOCK) {
+				nwritten = writev(wp->rio_fd, iov, iovcnt);
 			}
+		}
+		if (nwritten < 0) {
+			if (errno == EINTR || errno == EAGAIN ||
+			    errno == EWOULDBLOCK) {
+				continue; /* Wait again */
+			}
+			return -1; /* errno set by sendmsg() */
+		}
+
+		/* Skip the entries written, and the written part of the next */
+		while (iovcnt > 0 && nwritten >= iov->iov_len) {
+			nwritten -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + nwritten;
+			iov->iov_len -= nwritten;
+		}
+	}
+
+	wp->rio_iovcnt = 0;
+	wp->rio_len = 0;
+	return 0;
+}
+
+/*
+ * rio_writeb - Buffer n bytes for output, copying them into wp. Unless wp
+ *    is corked, they are written out before returning.
+ */
+ssize_t rio_writeb(rio_out_t *wp, const void *usrbuf, size_t n)
+{
+	size_t nleft = n;
+	const char *bufp = usrbuf;
+
+	while (nleft > 0) {
+		if (wp->rio_len == sizeof wp->rio_buf ||
+		    wp->rio_iovcnt == RIO_IOVMAX) {
+			if (rio_flushb(wp) < 0) {
+				return -1;
+			}
+		}
+
+		size_t cnt = sizeof wp->rio_buf - wp->rio_len;
+		if (nleft < cnt) {
+			cnt = nleft;
+		}
+		char *dst = wp->rio_buf + wp->rio_len;
+		memcpy(dst, bufp, cnt);
+
+		/* Grow the last entry if it ends where this copy begins */
+		struct iovec *last = wp->rio_iov + wp->rio_iovcnt - 1;
+		if (wp->rio_iovcnt > 0 &&
+		    (char *)last->iov_base + last->iov_len == dst) {
+			last->iov_len += cnt;
 		} else {
-			return -1; /* Error */
+			wp->rio_iov[wp->rio_iovcnt].iov_base = dst;
+			wp->rio_iov[wp->rio_iovcnt].iov_len = cnt;
+			++wp->rio_iovcnt;
 		}
+		wp->rio_len += cnt;
+		nleft -= cnt;
+		bufp += cnt;
+	}
+
+	if (!wp->rio_corked && rio_flushb(wp) < 0) {
+		return -1;
+	}
+	return n;
+}
+
+/*
+ * rio_writerefb - Queue n bytes for output without copying them; usrbuf
+ *    must stay valid until wp is flushed. Unless wp is corked, they are
+ *    written out before returning.
+ */
+ssize_t rio_writerefb(rio_out_t *wp, const void *usrbuf, size_t n)
+{
+	if (n == 0) {
+		return 0;
+	}
+	if (wp->rio_iovcnt == RIO_IOVMAX && rio_flushb(wp) < 0) {
+		return -1;
+	}
+
+	wp->rio_iov[wp->rio_iovcnt].iov_base = (void *)usrbuf;
+	wp->rio_iov[wp->rio_iovcnt].iov_len = n;
+	++wp->rio_iovcnt;
+
+	if (!wp->rio_corked && rio_flushb(wp) < 0) {
+		return -1;
+	}
+	return n;
+}
+
+/*
+ * rio_cork - Hold back output on wp until rio_uncork(), so a sequence of
+ *    small writes leaves in one writev() (and, usually, one segment)
+ */
+void rio_cork(rio_out_t *wp)
+{
+	wp->rio_corked = 1;
+}
+
+/*
+ * rio_uncork - Release output held back by rio_cork() and flush it
+ */
+int rio_uncork(rio_out_t *wp)
+{
+	wp->rio_corked = 0;
+	return rio_flushb(wp);
+}
+
+/*
+ * rio_setchunked - Frame everything written to wp from now on as HTTP/1.1
+ *    chunks, one per flush, until rio_endchunks()
+ */
+void rio_setchunked(rio_out_t *wp)
+{
+	wp->rio_chunked = 1;
+}
+
+/*
+ * rio_endchunks - Flush wp and write the last, empty chunk
+ */
+int rio_endchunks(rio_out_t *wp)
+{
+	static const char last_chunk[] = "0\r\n\r\n";
+
+	if (rio_flushb(wp) < 0) {
+		return -1;
+	}
+	wp->rio_chunked = 0;
+	if (rio_writerefb(wp, last_chunk, sizeof last_chunk - 1) < 0) {
+		return -1;
 	}
-	*bufp = 0;
-	return n - 1;
+	return rio_flushb(wp);
 }
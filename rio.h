@@ -2,6 +2,7 @@
 #define __RIO_H__
 
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /* Persistent state for the robust I/O (Rio) package */
 #define RIO_BUFSIZE 8192
@@ -9,10 +10,28 @@
 typedef struct {
 	int rio_fd;		   /* Descriptor for this internal buf */
 	int rio_cnt;		   /* Unread bytes in internal buf */
+	int rio_timeout;	   /* Max ms to wait for input, -1 for none */
+	long long rio_deadline;	   /* Absolute rio_now() deadline, 0 for none */
 	char *rio_bufptr;	   /* Next unread byte in internal buf */
 	char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
 } rio_t;
 
+/* Persistent state for buffered, vectored Rio output */
+#define RIO_IOVMAX 16
+
+typedef struct {
+	int rio_fd;			  /* Descriptor for this internal buf */
+	int rio_timeout;		  /* Max ms to wait, -1 for none */
+	long long rio_deadline;		  /* rio_now() deadline, 0 for none */
+	int rio_corked;			  /* Hold output until rio_uncork() */
+	int rio_chunked;		  /* Frame each flush as an HTTP chunk */
+	char rio_chunkhdr[24];		  /* Size line of the chunk in flight */
+	int rio_iovcnt;			  /* Pending entries in rio_iov */
+	size_t rio_len;			  /* Bytes used in internal buf */
+	struct iovec rio_iov[RIO_IOVMAX]; /* Pending output, in order */
+	char rio_buf[RIO_BUFSIZE];	  /* Internal buffer */
+} rio_out_t;
+
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, const void *usrbuf, size_t n);
@@ -20,4 +39,19 @@ void rio_readinitb(rio_t *rp, int fd);
 ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 
+/* Timeout support */
+long long rio_now(void);
+int rio_wait(int fd, short events, int timeout, long long deadline);
+void rio_settimeout(rio_t *rp, int timeout, long long deadline);
+
+/* Buffered output */
+void rio_writeinitb(rio_out_t *wp, int fd, int timeout, long long deadline);
+ssize_t rio_writeb(rio_out_t *wp, const void *usrbuf, size_t n);
+ssize_t rio_writerefb(rio_out_t *wp, const void *usrbuf, size_t n);
+int rio_flushb(rio_out_t *wp);
+void rio_cork(rio_out_t *wp);
+int rio_uncork(rio_out_t *wp);
+void rio_setchunked(rio_out_t *wp);
+int rio_endchunks(rio_out_t *wp);
+
 #endif /* __RIO_H__ */
@@ -0,0 +1,509 @@
+/*****************************************************
+ * URI parsing and canonicalization (for cache keys)
+ *****************************************************/
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "uri.h"
+#include "utils.h"
+
+#define MAXPARAMS 64 /* Max query parameters sorted by canon_uri() */
+
+/* The pieces of a URI, as spans of the original string */
+struct uri_parts {
+	const char *scheme, *host, *port, *path, *query;
+	size_t scheme_len, host_len, port_len, path_len, query_len;
+	int bracketed; /* host is an IPv6 literal */
+};
+
+/* Query parameters dropped from cache keys, and whether to sort the rest */
+static char **strip_rules;
+static int nstrip_rules;
+static int sort_params;
+
+/*
+ * split_uri - find the scheme, host, port, path and query of uri. Absent
+ *     pieces get zero length (the query is NULL only if there is no '?').
+ *     Returns -1 if uri has no usable host or a malformed port.
+ */
+static int split_uri(const char *uri, struct uri_parts *u)
+{
+	memset(u, 0, sizeof *u);
+
+	/* Scheme, if uri starts with one followed by "://" */
+	const char *p = uri;
+	const size_t scheme_len =
+	    strspn(uri, "abcdefghijklmnopqrstuvwxyz"
+			"ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+-.");
+	if (scheme_len > 0 && isalpha((unsigned char)uri[0]) &&
+	    strncmp(uri + scheme_len, "://", 3) == 0) {
+		u->scheme = uri;
+		u->scheme_len = scheme_len;
+		p += scheme_len + 3;
+	}
+
+	/* Authority, skipping any userinfo */
+	const size_t auth_len = strcspn(p, "/?#");
+	const char *auth_end = p + auth_len;
+	for (const char *at = p; at < auth_end; ++at) {
+		if (*at == '@') {
+			p = at + 1;
+		}
+	}
+
+	const char *host_end;
+	if (*p == '[') {
+		const char *close = memchr(p, ']', auth_end - p);
+		if (close == NULL) {
+			return -1;
+		}
+		u->host = p + 1;
+		u->host_len = close - u->host;
+		u->bracketed = 1;
+		host_end = close + 1;
+	} else {
+		host_end = memchr(p, ':', auth_end - p);
+		if (host_end == NULL) {
+			host_end = auth_end;
+		}
+		u->host = p;
+		u->host_len = host_end - p;
+	}
+	if (u->host_len == 0 || u->host_len >= NI_MAXHOST) {
+		return -1;
+	}
+
+	if (host_end < auth_end) {
+		if (*host_end != ':') {
+			return -1;
+		}
+		u->port = host_end + 1;
+		u->port_len = auth_end - u->port;
+		if (strspn(u->port, "0123456789") < u->port_len) {
+			return -1;
+		}
+	}
+
+	/* Path, query, and a fragment to be ignored */
+	u->path = auth_end;
+	u->path_len = strcspn(u->path, "?#");
+	if (u->path[u->path_len] == '?') {
+		u->query = u->path + u->path_len + 1;
+		u->query_len = strcspn(u->query, "#");
+	}
+
+	return 0;
+}
+
+/*
+ * default_port - the port implied by a scheme, http's if there is none
+ */
+static const char *default_port(const struct uri_parts *u)
+{
+	if (u->scheme_len == 5 && strncasecmp(u->scheme, "https", 5) == 0) {
+		return "443";
+	}
+	return "80";
+}
+
+/*
+ * parse_uri - split uri into the host and service to connect to and the
+ *     path (with query) to request from it
+ */
+int parse_uri(const char *uri, struct uri *u)
+{
+	struct uri_parts parts;
+
+	printf("DEBUG: parse_uri: %s\n", uri);
+	if (split_uri(uri, &parts) < 0) {
+		return -1;
+	}
+
+	memcpy(u->host, parts.host, parts.host_len);
+	u->host[parts.host_len] = '\0';
+
+	if (parts.port_len == 0) {
+		/* Implicit port */
+		strcpy(u->service, default_port(&parts));
+	} else if (parts.port_len < NI_MAXSERV) {
+		memcpy(u->service, parts.port, parts.port_len);
+		u->service[parts.port_len] = '\0';
+	} else {
+		return -1;
+	}
+
+	u->path = parts.path;
+	u->path_len = parts.path_len;
+	if (parts.query != NULL) {
+		u->path_len += 1 + parts.query_len;
+	}
+
+	return 0;
+}
+
+/* Output cursor for canon_uri(), which fails once it runs out of room */
+struct out {
+	char *p, *end;
+};
+
+static int put(struct out *o, const char *s, size_t n)
+{
+	if (n > o->end - o->p) {
+		return -1;
+	}
+	memcpy(o->p, s, n);
+	o->p += n;
+	return 0;
+}
+
+static int put_lower(struct out *o, const char *s, size_t n)
+{
+	if (n > o->end - o->p) {
+		return -1;
+	}
+	for (size_t i = 0; i < n; ++i) {
+		*o->p++ = tolower((unsigned char)s[i]);
+	}
+	return 0;
+}
+
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * put_pct - copy s, decoding percent-encoded unreserved characters and
+ *     upper-casing the hex digits of the other escapes (RFC 3986 6.2.2)
+ */
+static int put_pct(struct out *o, const char *s, size_t n)
+{
+	static const char hex[] = "0123456789ABCDEF";
+
+	for (size_t i = 0; i < n; ++i) {
+		int hi, lo;
+		if (o->p == o->end) {
+			return -1;
+		}
+		if (s[i] != '%' || i + 2 >= n || (hi = hexval(s[i + 1])) < 0 ||
+		    (lo = hexval(s[i + 2])) < 0) {
+			*o->p++ = s[i];
+			continue;
+		}
+
+		const char c = hi << 4 | lo;
+		/* strchr() would find '\0', so %00 stays escaped */
+		if (isalnum((unsigned char)c) ||
+		    (c != '\0' && strchr("-._~", c) != NULL)) {
+			*o->p++ = c;
+		} else {
+			if (o->end - o->p < 3) {
+				return -1;
+			}
+			*o->p++ = '%';
+			*o->p++ = hex[hi];
+			*o->p++ = hex[lo];
+		}
+		i += 2;
+	}
+	return 0;
+}
+
+/*
+ * remove_dot_segments - resolve "." and ".." segments of the absolute path
+ *     of len bytes at path in place (RFC 3986 5.2.4); returns the new length
+ */
+static size_t remove_dot_segments(char *path, size_t len)
+{
+	size_t in = 0, out = 0;
+
+	while (in < len) {
+		/* path[in] is the '/' opening a segment */
+		size_t end = in + 1;
+		while (end < len && path[end] != '/') {
+			++end;
+		}
+		const char *seg = path + in + 1;
+		const size_t seg_len = end - in - 1;
+
+		if (seg_len == 1 && seg[0] == '.') {
+			/* Drop it, but keep the directory if it is last */
+			if (end == len) {
+				path[out++] = '/';
+			}
+		} else if (seg_len == 2 && seg[0] == '.' && seg[1] == '.') {
+			/* Drop it and the segment before it */
+			while (out > 0 && path[--out] != '/')
+				;
+			if (end == len) {
+				path[out++] = '/';
+			}
+		} else {
+			memmove(path + out, path + in, end - in);
+			out += end - in;
+		}
+		in = end;
+	}
+
+	if (out == 0) {
+		path[out++] = '/';
+	}
+	return out;
+}
+
+/*
+ * stripped - whether the query parameter param (of n bytes) is dropped by
+ *     the strip rules, each of which is a name or a "prefix*" pattern
+ */
+static int stripped(const char *param, size_t n)
+{
+	const size_t name_len = strcspn(param, "=&");
+	if (name_len < n) {
+		n = name_len;
+	}
+
+	for (int i = 0; i < nstrip_rules; ++i) {
+		const char *rule = strip_rules[i];
+		const size_t rule_len = strlen(rule);
+		if (rule_len > 0 && rule[rule_len - 1] == '*') {
+			if (n >= rule_len - 1 &&
+			    strncmp(param, rule, rule_len - 1) == 0) {
+				return 1;
+			}
+		} else if (n == rule_len && strncmp(param, rule, n) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+struct span {
+	const char *p;
+	size_t n;
+};
+
+static int cmp_span(const void *a, const void *b)
+{
+	const struct span *x = a, *y = b;
+	const int rc = memcmp(x->p, y->p, x->n < y->n ? x->n : y->n);
+	if (rc != 0) {
+		return rc;
+	}
+	return (x->n > y->n) - (x->n < y->n);
+}
+
+/*
+ * put_query - append the normalized query, without the parameters the strip
+ *     rules drop and, if configured, with the rest sorted
+ */
+static int put_query(struct out *o, const char *query, size_t n)
+{
+	char *start = o->p;
+	struct span params[MAXPARAMS];
+	int nparams = 0, sortable = 1;
+
+	if (put(o, "?", 1) < 0) {
+		return -1;
+	}
+
+	/* Normalize each kept parameter in place in the output */
+	for (const char *p = query, *end = query + n; p < end;) {
+		const char *amp = memchr(p, '&', end - p);
+		const size_t len = (amp ? amp : end) - p;
+
+		if (len > 0) {
+			if (o->p - start > 1 && put(o, "&", 1) < 0) {
+				return -1;
+			}
+			char *param = o->p;
+			if (put_pct(o, p, len) < 0) {
+				return -1;
+			}
+			if (stripped(param, o->p - param)) {
+				o->p = param == start + 1 ? param : param - 1;
+			} else if (nparams < MAXPARAMS) {
+				params[nparams].p = param;
+				params[nparams++].n = o->p - param;
+			} else {
+				sortable = 0;
+			}
+		}
+		p += len + 1;
+	}
+
+	if (o->p == start + 1) {
+		/* Nothing left; drop the '?' */
+		o->p = start;
+		return 0;
+	}
+
+	if (sort_params && sortable && nparams > 1) {
+		const size_t len = o->p - (start + 1);
+		char *tmp = malloc(len);
+		if (tmp == NULL) {
+			msg_unix_error("malloc");
+			return -1;
+		}
+		memcpy(tmp, start + 1, len);
+		for (int i = 0; i < nparams; ++i) {
+			params[i].p = tmp + (params[i].p - (start + 1));
+		}
+		qsort(params, nparams, sizeof *params, cmp_span);
+
+		o->p = start + 1;
+		for (int i = 0; i < nparams; ++i) {
+			if (i > 0) {
+				*o->p++ = '&';
+			}
+			memcpy(o->p, params[i].p, params[i].n);
+			o->p += params[i].n;
+		}
+		free(tmp);
+	}
+	return 0;
+}
+
+/*
+ * canon_uri - write the canonical form of uri, used as its cache key, to
+ *     key: scheme and host lower-cased, default port and fragment dropped,
+ *     percent-encoding normalized, dot segments resolved, and the query
+ *     rewritten by the rules from set_query_rules(). Returns -1 if uri is
+ *     malformed or its canonical form needs more than keylen bytes.
+ */
+int canon_uri(const char *uri, char *key, size_t keylen)
+{
+	struct uri_parts u;
+	struct out o = {key, key + keylen - 1};
+
+	if (keylen == 0 || split_uri(uri, &u) < 0) {
+		return -1;
+	}
+
+	/* scheme://host[:port] */
+	if (u.scheme_len == 0) {
+		if (put(&o, "http", 4) < 0)
+			return -1;
+	} else if (put_lower(&o, u.scheme, u.scheme_len) < 0) {
+		return -1;
+	}
+	if (put(&o, "://", 3) < 0 || (u.bracketed && put(&o, "[", 1) < 0) ||
+	    put_lower(&o, u.host, u.host_len) < 0 ||
+	    (u.bracketed && put(&o, "]", 1) < 0)) {
+		return -1;
+	}
+	while (u.port_len > 1 && *u.port == '0') {
+		++u.port;
+		--u.port_len;
+	}
+	const char *dflt = default_port(&u);
+	if (u.port_len > 0 && (u.port_len != strlen(dflt) ||
+			       strncmp(u.port, dflt, u.port_len) != 0)) {
+		if (put(&o, ":", 1) < 0 || put(&o, u.port, u.port_len) < 0) {
+			return -1;
+		}
+	}
+
+	/* path, which is at least "/" */
+	char *path = o.p;
+	if (u.path_len == 0 || u.path[0] != '/') {
+		if (put(&o, "/", 1) < 0)
+			return -1;
+	}
+	if (put_pct(&o, u.path, u.path_len) < 0) {
+		return -1;
+	}
+	o.p = path + remove_dot_segments(path, o.p - path);
+
+	/* ?query */
+	if (u.query != NULL && put_query(&o, u.query, u.query_len) < 0) {
+		return -1;
+	}
+
+	*o.p = '\0';
+	return 0;
+}
+
+/*
+ * set_query_rules - make canon_uri() drop the query parameters named in the
+ *     comma-separated list strip (a trailing '*' matches any suffix), and
+ *     sort the remaining ones if sort is set
+ */
+int set_query_rules(const char *strip, int sort)
+{
+	sort_params = sort;
+	if (strip == NULL) {
+		return 0;
+	}
+
+	for (const char *p = strip; *p;) {
+		const size_t len = strcspn(p, ",");
+		if (len > 0) {
+			char **rules = realloc(strip_rules, (nstrip_rules + 1) *
+							       sizeof *rules);
+			if (rules == NULL) {
+				msg_unix_error("realloc");
+				return -1;
+			}
+			strip_rules = rules;
+			if ((rules[nstrip_rules] = strndup(p, len)) == NULL) {
+				msg_unix_error("strndup");
+				return -1;
+			}
+			++nstrip_rules;
+		}
+		p += len + (p[len] == ',');
+	}
+	return 0;
+}
+
+/*
+ * query_param - copy the value of the query parameter name in uri to val,
+ *     percent-decoded and with '+' as a space. Returns -1 if uri has no such
+ *     parameter or its value needs more than len bytes.
+ */
+int query_param(const char *uri, const char *name, char *val, size_t len)
+{
+	const char *q = strchr(uri, '?');
+	if (q == NULL || len == 0) {
+		return -1;
+	}
+	const char *end = q + 1 + strcspn(q + 1, "#");
+	const size_t name_len = strlen(name);
+
+	for (const char *p = q + 1; p < end;) {
+		const char *amp = memchr(p, '&', end - p);
+		const char *p_end = amp ? amp : end;
+		if (p_end - p > name_len && p[name_len] == '=' &&
+		    strncmp(p, name, name_len) == 0) {
+			size_t n = 0;
+			for (const char *v = p + name_len + 1; v < p_end; ++v) {
+				int hi, lo;
+				if (n + 1 >= len) {
+					return -1;
+				}
+				if (*v == '%' && p_end - v > 2 &&
+				    (hi = hexval(v[1])) >= 0 &&
+				    (lo = hexval(v[2])) >= 0) {
+					val[n++] = hi << 4 | lo;
+					v += 2;
+				} else {
+					val[n++] = *v == '+' ? ' ' : *v;
+				}
+			}
+			val[n] = '\0';
+			return 0;
+		}
+		p = p_end + 1;
+	}
+	return -1;
+}
@@ -0,0 +1,20 @@
+#ifndef __URI_H__
+#define __URI_H__
+
+#include <netdb.h>
+#include <stddef.h>
+
+/* An absolute-form request URI, split for connecting and forwarding */
+struct uri {
+	char host[NI_MAXHOST];	  /* Without IPv6 brackets */
+	char service[NI_MAXSERV]; /* Port, or the scheme's default */
+	const char *path;	  /* Path and query, pointing into the URI */
+	size_t path_len;	  /* Excluding any fragment; 0 means "/" */
+};
+
+int parse_uri(const char *uri, struct uri *u);
+int canon_uri(const char *uri, char *key, size_t keylen);
+int set_query_rules(const char *strip, int sort);
+int query_param(const char *uri, const char *name, char *val, size_t len);
+
+#endif /* __URI_H__ */
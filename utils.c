@@ -2,31 +2,85 @@
  * Client/server helper functions
  ********************************/
 
+#include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/errno.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include "rio.h"
 #include "utils.h"
 
 #define LISTENQ 1024 /* Second argument to listen() */
+#define MAXADDRS 32  /* Max addresses raced by open_clientfd() */
+
+/*
+ * start_connect - Create a non-blocking socket for address p and begin
+ *     connecting it. Sets *done once the connection is already up.
+ *     Returns the descriptor, or -1 with errno set.
+ */
+static int start_connect(const struct addrinfo *p, int bufsize, int *done)
+{
+	int fd, flags;
+
+	/* Create a socket descriptor */
+	if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+		return -1;
+	}
+
+	/* Buffer sizes must be set before connecting to affect the window */
+	if (bufsize > 0) {
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof bufsize);
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof bufsize);
+	}
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0 ||
+	    fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		goto err;
+	}
+
+	/* Connect to the server */
+	*done = connect(fd, p->ai_addr, p->ai_addrlen) == 0;
+	if (!*done && errno != EINPROGRESS) {
+		goto err;
+	}
+	return fd;
+
+err:;
+	const int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return -1;
+}
 
 /*
  * open_clientfd - Open connection to server at <hostname, port> and
  *     return a socket descriptor ready for reading and writing. This
  *     function is reentrant and protocol-independent.
  *
+ *     Addresses are raced Happy Eyeballs style (RFC 8305): address
+ *     families are interleaved, a new attempt starts every delay ms (or
+ *     as soon as one fails) while earlier ones stay in flight, and the
+ *     first to connect wins. The whole race gives up after timeout ms
+ *     (-1 for no limit). The winner gets TCP_NODELAY and, if bufsize is
+ *     positive, send and receive buffers of bufsize bytes.
+ *
  *     On error, returns:
  *       -2 for getaddrinfo error
  *       -1 with errno set for other errors.
  */
-int open_clientfd(char *hostname, char *port)
+int open_clientfd(char *hostname, char *port, int timeout, int delay,
+		  int bufsize)
 {
-	int clientfd, rc;
-	struct addrinfo hints, *listp, *p;
+	int clientfd = -1, rc, err = ETIMEDOUT;
+	struct addrinfo hints, *listp;
 
 	/* Get a list of potential server addresses */
 	memset(&hints, 0, sizeof(struct addrinfo));
@@ -39,30 +93,119 @@ int open_clientfd(char *hostname, char *port)
 		return -2;
 	}
 
-	/* Walk the list for one that we can successfully connect to */
-	for (p = listp; p; p = p->ai_next) {
-		/* Create a socket descriptor */
-		if ((clientfd = socket(p->ai_family, p->ai_socktype,
-				       p->ai_protocol)) < 0)
-			continue; /* Socket failed, try the next */
+	/* Interleave the families, keeping the resolver's preferred one first
+	 * and the resolver's order within each family */
+	const struct addrinfo *addrs[MAXADDRS];
+	int naddrs = 0;
+	const int first = listp->ai_family;
+	struct addrinfo *same = listp, *other = listp;
+	while (naddrs < MAXADDRS) {
+		while (same && same->ai_family != first)
+			same = same->ai_next;
+		while (other && other->ai_family == first)
+			other = other->ai_next;
+		if (!same && !other)
+			break;
+		if (same) {
+			addrs[naddrs++] = same;
+			same = same->ai_next;
+		}
+		if (other && naddrs < MAXADDRS) {
+			addrs[naddrs++] = other;
+			other = other->ai_next;
+		}
+	}
 
-		/* Connect to the server */
-		if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1)
-			break; /* Success */
-		if (close(clientfd) < 0) {
-			/* Connect failed, try another */ // line:netp:openclientfd:closefd
-			fprintf(stderr, "open_clientfd: close failed: %s\n",
-				strerror(errno));
-			return -1;
+	/* Race the addresses, starting a new attempt every delay ms */
+	struct pollfd pfds[MAXADDRS];
+	int npending = 0, next = 0;
+	const long long deadline = timeout >= 0 ? rio_now() + timeout : 0;
+	long long next_start = 0;
+
+	while (clientfd < 0 && (next < naddrs || npending > 0)) {
+		const long long now = rio_now();
+		if (deadline && now >= deadline) {
+			err = ETIMEDOUT;
+			break;
+		}
+
+		if (next < naddrs && (npending == 0 || now >= next_start)) {
+			int done;
+			const int fd = start_connect(addrs[next++], bufsize,
+						     &done);
+			if (fd < 0) {
+				err = errno; /* Failed outright, try the next */
+				continue;
+			}
+			if (done) {
+				clientfd = fd;
+				break;
+			}
+			pfds[npending].fd = fd;
+			pfds[npending].events = POLLOUT;
+			pfds[npending].revents = 0;
+			++npending;
+			next_start = now + delay;
+			continue;
+		}
+
+		/* Wait for an attempt to finish or the next one to be due */
+		long long wait = next < naddrs ? next_start - now : -1;
+		if (deadline && (wait < 0 || deadline - now < wait)) {
+			wait = deadline - now;
+		}
+		if ((rc = poll(pfds, npending, wait)) < 0) {
+			if (errno == EINTR)
+				continue;
+			err = errno;
+			break;
+		}
+
+		for (int i = 0; i < npending; ++i) {
+			if (!pfds[i].revents)
+				continue;
+
+			int so_err = 0;
+			socklen_t errlen = sizeof so_err;
+			if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR,
+				       &so_err, &errlen) < 0) {
+				so_err = errno;
+			}
+			if (so_err == 0) {
+				clientfd = pfds[i].fd;
+			} else {
+				/* Failed; the next attempt need not wait */
+				err = so_err;
+				close(pfds[i].fd);
+				next_start = now;
+			}
+			pfds[i--] = pfds[--npending];
+			if (clientfd >= 0)
+				break;
 		}
 	}
 
-	/* Clean up */
+	/* Clean up the losers */
+	for (int i = 0; i < npending; ++i) {
+		close(pfds[i].fd);
+	}
 	freeaddrinfo(listp);
-	if (!p) /* All connects failed */
+	if (clientfd < 0) { /* All connects failed */
+		errno = err;
+		return -1;
+	}
+
+	/* Hand back a blocking descriptor, as the callers expect */
+	int flags, optval = 1;
+	if ((flags = fcntl(clientfd, F_GETFL)) < 0 ||
+	    fcntl(clientfd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+		err = errno;
+		close(clientfd);
+		errno = err;
 		return -1;
-	else /* The last connect succeeded */
-		return clientfd;
+	}
+	setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof optval);
+	return clientfd;
 }
 
 /*
@@ -124,6 +267,132 @@ int open_listenfd(char *port)
 	return listenfd;
 }
 
+/*
+ * open_unixlistenfd - Open and return a Unix-domain listening socket bound
+ *     to path, replacing any stale socket file there.
+ *
+ *     On error, returns -1 with errno set.
+ */
+int open_unixlistenfd(const char *path)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	int listenfd;
+
+	if (strlen(path) >= sizeof addr.sun_path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	if ((listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+	unlink(path);
+	if (bind(listenfd, (SA *)&addr, sizeof addr) < 0 ||
+	    listen(listenfd, 1) < 0) {
+		const int saved_errno = errno;
+		close(listenfd);
+		errno = saved_errno;
+		return -1;
+	}
+	return listenfd;
+}
+
+/*
+ * open_unixclientfd - Open connection to the Unix-domain socket at path.
+ *
+ *     On error, returns -1 with errno set.
+ */
+int open_unixclientfd(const char *path)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	int clientfd;
+
+	if (strlen(path) >= sizeof addr.sun_path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	if ((clientfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+	if (connect(clientfd, (SA *)&addr, sizeof addr) < 0) {
+		const int saved_errno = errno;
+		close(clientfd);
+		errno = saved_errno;
+		return -1;
+	}
+	return clientfd;
+}
+
+/*
+ * send_fd - Pass descriptor fd, along with the byte tag, over the
+ *     Unix-domain socket sockfd (SCM_RIGHTS). Returns 0, or -1 with errno set.
+ */
+int send_fd(int sockfd, int fd, char tag)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct iovec iov = {&tag, 1};
+	struct msghdr msg = {0};
+	ssize_t rc;
+
+	memset(&ctl, 0, sizeof ctl);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof ctl.buf;
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	while ((rc = sendmsg(sockfd, &msg, 0)) < 0 && errno == EINTR)
+		;
+	return rc < 0 ? -1 : 0;
+}
+
+/*
+ * recv_fd - Receive a descriptor and its byte tag sent by send_fd().
+ *     Returns the descriptor, or -1 with errno set.
+ */
+int recv_fd(int sockfd, char *tag)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct iovec iov = {tag, 1};
+	struct msghdr msg = {0};
+	ssize_t rc;
+	int fd;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof ctl.buf;
+
+	while ((rc = recvmsg(sockfd, &msg, 0)) < 0 && errno == EINTR)
+		;
+	if (rc < 0) {
+		return -1;
+	}
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (rc == 0 || cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS) {
+		errno = EPROTO;
+		return -1;
+	}
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
 void msg_posix_error(int code, char *msg) /* Posix-style error */
 {
 	fprintf(stderr, "%s: %s\n", msg, strerror(code));
@@ -151,10 +420,11 @@ void posix_error(int code, char *msg) /* Posix-style error */
 	exit(0);
 }
 
-int Open_clientfd(char *hostname, char *port)
+int Open_clientfd(char *hostname, char *port, int timeout, int delay,
+		  int bufsize)
 {
 	int rc;
-	if ((rc = open_clientfd(hostname, port)) < 0) {
+	if ((rc = open_clientfd(hostname, port, timeout, delay, bufsize)) < 0) {
 		unix_error("Open_clientfd error");
 	}
 	return rc;
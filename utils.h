@@ -4,9 +4,16 @@
 typedef struct sockaddr SA;
 
 /* Reentrant protocol-independent client/server helpers */
-int open_clientfd(char *hostname, char *port);
+int open_clientfd(char *hostname, char *port, int timeout, int delay,
+		  int bufsize);
 int open_listenfd(char *port);
 
+/* Unix-domain helpers, for handing the listener to a new process */
+int open_unixlistenfd(const char *path);
+int open_unixclientfd(const char *path);
+int send_fd(int sockfd, int fd, char tag);
+int recv_fd(int sockfd, char *tag);
+
 void msg_unix_error(char *msg);
 void msg_posix_error(int code, char *msg);
 void msg_gai_error(int code, char *msg);
@@ -14,7 +21,8 @@ void msg_gai_error(int code, char *msg);
 void unix_error(char *msg);
 void posix_error(int code, char *msg);
 
-int Open_clientfd(char *hostname, char *port);
+int Open_clientfd(char *hostname, char *port, int timeout, int delay,
+		  int bufsize);
 int Open_listenfd(char *port);
 
 #endif /* __UTILS_H__ */